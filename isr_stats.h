@@ -0,0 +1,84 @@
+// Copyright 2022-2025 Kevin Williams (TexElec.com), Michael Steil, Joe Burks,
+// Stefan Jakobsson, Eirik Stople, and other contributors.
+// 
+// Redistribution and use in source and binary forms, with or without 
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, 
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <Arduino.h>
+#include <avr/io.h>
+
+// Measure interrupt handler run times, readable at I2C offset 0x62.
+// Adds about 2 us to each measured handler, keep it off in release builds.
+//#define ENABLE_ISR_STATS
+
+enum ISR_STATS_VECTOR : uint8_t {
+  ISR_STATS_USI_START = 0,
+  ISR_STATS_USI_OVF,
+  ISR_STATS_TIMER1,
+  ISR_STATS_KBD_CLOCK,
+  ISR_STATS_MSE_CLOCK,
+  ISR_STATS_COUNT
+};
+
+#if defined(ENABLE_ISR_STATS)
+
+struct IsrStats {
+  uint16_t count;     // Saturates at 0xffff
+  uint16_t average;   // Moving average over about 16 calls, 8.8 fixed point us
+  uint8_t max;        // us
+};
+
+extern volatile IsrStats isrStats[ISR_STATS_COUNT];
+extern volatile uint8_t isrMaxLatency;
+
+// Timer 1 is the time base: it counts 1 us steps and is reset to 0 by its own compare match
+// interrupt every 100 us. Interrupts don't nest, so the counter is never reset while another
+// handler runs, and the 8 bit difference is valid for handlers shorter than 256 us.
+#define ISR_STATS_BEGIN()           uint8_t isrStatsStart = TCNT1
+#define ISR_STATS_END(vector)       isrStatsUpdate(vector, (uint8_t)(TCNT1 - isrStatsStart))
+
+// For the Timer 1 handler itself: the counter value past the compare match is the time the
+// interrupt was held off by other handlers or by code running with interrupts disabled.
+// Must be used right before the counter is reset.
+#define ISR_STATS_BEGIN_TIMER1()    uint8_t isrStatsStart = 0; isrStatsLatency(TCNT1 - OCR1A)
+
+static inline void isrStatsUpdate(uint8_t vector, uint8_t time) {
+  volatile IsrStats &s = isrStats[vector];
+  if (s.count == 0) s.average = (uint16_t)time << 8;
+  s.average = s.average - (s.average >> 4) + ((uint16_t)time << 4);
+  if (time > s.max) s.max = time;
+  if (s.count != 0xffff) s.count++;
+}
+
+static inline void isrStatsLatency(uint8_t latency) {
+  if (latency > isrMaxLatency) isrMaxLatency = latency;
+}
+
+#else
+
+#define ISR_STATS_BEGIN()           do {} while(0)
+#define ISR_STATS_END(vector)       do {} while(0)
+#define ISR_STATS_BEGIN_TIMER1()    do {} while(0)
+
+#endif
@@ -26,52 +26,269 @@
 #pragma once
 
 #include <Arduino.h>
+#include <avr/eeprom.h>
 #include "setup_ps2.h"
 #include "optimized_gpio.h"
-#define SCANCODE_TIMEOUT_MS 50
+#define SCANCODE_TIMEOUT_TICKS 500    // 50 ms in 100 us timer ticks, silence that ends a multi-byte scan code
+#define BIT_TIMEOUT_TICKS 3           // 200-300 us without clock within a frame, the spec allows 100 us per bit
+#define PS2_RESEND 0xFE               // Host to device Resend command
+#define MAX_RESENDS 3                 // Resend requests for one byte before it's dropped
+#define PS2_TX_QUEUE_SIZE 8           // Bytes in one command sequence sent to the device
+#define PS2_REPLY_SIZE 8              // Reply bytes kept from a command sequence
+#define PS2_CMD_SIZE 2                // Bytes in a command sent by the SMC itself, command and parameter
+#define MAX_CMD_RETRIES 3             // Times a byte is sent again when the device answers Resend
+#define REPLY_TIMEOUT_TICKS 100       // 10 ms in 100 us timer ticks, silence that ends a reply
+#define SEND_TIMEOUT_TICKS 150        // 15 ms in 100 us timer ticks, time the device has to clock in a byte
+#define PS2_RAW_QUEUE_SIZE 8          // Received bytes waiting to be decoded in the main loop, must be a power of 2, at most 8
 
 bool PWR_ON_active();
+extern volatile uint16_t timerTicks;
 
 enum PS2_CMD_STATUS : uint8_t {
   IDLE = 0,
   CMD_PENDING = 1,
+  CMD_TIMEOUT = 2,      // The device didn't clock in the command, it's not connected
   CMD_ACK = 0xFA,
   CMD_ERR = 0xFE
 };
 
+// Saturating 16 bit performance and error counters, kept per port
+enum PS2_STAT : uint8_t {
+  PS2_STAT_RX_BYTES = 0,      // Bytes received
+  PS2_STAT_PARITY_ERR,        // Bytes received with parity error
+  PS2_STAT_FRAMING_ERR,       // Missing start or stop bit
+  PS2_STAT_OVERRUN,           // Keyboard: key codes dropped on buffer full; Mouse: bytes dropped on buffer full; both: raw queue full
+  PS2_STAT_COALESCED,         // Mouse packets merged into the previous packet
+  PS2_STAT_OVERFLOW,          // Mouse packets with overflow bits set, discarded
+  PS2_STAT_WATCHDOG,          // Initialization watchdog expiries
+  PS2_STAT_COUNT
+};
+
+// Block pool shared by the input buffers of all PS/2 ports. A port takes
+// blocks as its buffer fills up and returns them when they have been read,
+// within the per-device quotas below.
+#define PS2_POOL_BLOCK_SIZE 8         // Bytes per block, must be a power of 2
+#define PS2_POOL_BLOCKS 4             // Total number of blocks, at most 8
+#define PS2_POOL_KEYBOARD 0
+#define PS2_POOL_MOUSE 1
+#define PS2_POOL_KBD_MIN_BLOCKS 1     // Blocks always available to the keyboard
+#define PS2_POOL_KBD_MAX_BLOCKS 3     // Most blocks the keyboard may use
+#define PS2_POOL_MSE_MIN_BLOCKS 1
+#define PS2_POOL_MSE_MAX_BLOCKS 3
+
+class PS2BlockPool
+{
+  public:
+    volatile uint8_t data[PS2_POOL_BLOCKS][PS2_POOL_BLOCK_SIZE];
+
+    /// @brief Takes a block for a device
+    /// @return Block number + 1, or 0 if the device's quota or the pool is exhausted
+    /// @attention Must be called with interrupts disabled
+    uint8_t alloc(uint8_t device) {
+      if (!canAlloc(device)) return 0;
+
+      uint8_t mask = 1;
+      for (uint8_t b = 1; b <= PS2_POOL_BLOCKS; b++) {
+        if ((taken & mask) == 0) {
+          taken |= mask;
+          used[device]++;
+          return b;
+        }
+        mask = mask << 1;
+      }
+      return 0;
+    }
+
+    /// @brief Returns true if alloc() would succeed for the device
+    bool canAlloc(uint8_t device) {
+      if (used[device] >= maxBlocks(device)) return false;
+
+      // Keep the blocks guaranteed to the other device
+      uint8_t other = device ^ 1;
+      uint8_t reserved = (used[other] < minBlocks(other)) ? minBlocks(other) - used[other] : 0;
+      return freeBlocks() > reserved;
+    }
+
+    /// @brief Returns a block taken with alloc()
+    /// @attention Must be called with interrupts disabled
+    void release(uint8_t device, uint8_t block) {
+      taken &= ~(1 << (block - 1));
+      used[device]--;
+    }
+
+    uint8_t blocksUsed(uint8_t device) {
+      return used[device];
+    }
+
+    uint8_t freeBlocks() {
+      return PS2_POOL_BLOCKS - used[PS2_POOL_KEYBOARD] - used[PS2_POOL_MOUSE];
+    }
+
+  private:
+    volatile uint8_t taken = 0;       // Bit n set = block n+1 in use
+    volatile uint8_t used[2] = {0, 0};
+
+    static uint8_t minBlocks(uint8_t device) {
+      return device == PS2_POOL_KEYBOARD ? PS2_POOL_KBD_MIN_BLOCKS : PS2_POOL_MSE_MIN_BLOCKS;
+    }
+
+    static uint8_t maxBlocks(uint8_t device) {
+      return device == PS2_POOL_KEYBOARD ? PS2_POOL_KBD_MAX_BLOCKS : PS2_POOL_MSE_MAX_BLOCKS;
+    }
+};
+
+static_assert(PS2_POOL_KBD_MIN_BLOCKS + PS2_POOL_MSE_MIN_BLOCKS <= PS2_POOL_BLOCKS);
+static_assert(PS2_RAW_QUEUE_SIZE <= 8 && (PS2_RAW_QUEUE_SIZE & (PS2_RAW_QUEUE_SIZE - 1)) == 0, "One error bit per raw queue entry");
+
+extern PS2BlockPool ps2Pool;
+
+// Command sequence from the host, and the reply to it. Only one sequence is in
+// flight at a time, so the buffer is shared by the PS/2 ports; the port that
+// started the last sequence owns it.
+struct PS2HostSequence
+{
+  volatile uint8_t data[PS2_TX_QUEUE_SIZE];
+  volatile uint8_t reply[PS2_REPLY_SIZE];
+  volatile uint8_t replySize = 0;
+  volatile uint8_t owner = PS2_POOL_KEYBOARD;   // Device whose sequence is in the buffer
+  volatile bool sending = false;                // The owner is still sending the sequence
+};
+
+extern PS2HostSequence ps2HostSeq;
+
 /// @brief PS/2 IO Port handler
-/// @tparam size Circular buffer size for incoming data, must be a power of 2 and not more than 256
-template<uint8_t clkPin, uint8_t datPin, uint8_t size = 16> // Single keycodes can be 4 bytes long. We want a little bit of margin here.
+/// @tparam size Circular buffer size for incoming data, must be a power of 2 and not more than 256.
+/// Buffer space is taken from ps2Pool, one block at a time; the port may also be limited by its pool quota.
+/// @tparam Derived The device class. Its resetInput(), flush(), processByteReceived(), receiveError() and
+/// restartCode() are called by the port at compile time instead of through virtual functions, so that they can be
+/// inlined. The device class only needs to define the ones it changes. It also sets RESEND_REPEATS_PACKET
+/// if the device answers Resend with its whole last packet instead of only the last byte.
+///
+/// The clock interrupt only assembles bytes and handles the command protocol. Received bytes are
+/// put in a raw queue, and decoded by the device class when the main loop calls decodeNext().
+template<uint8_t clkPin, uint8_t datPin, uint8_t size, class Derived> // Single keycodes can be 4 bytes long. We want a little bit of margin here.
 class PS2Port
 {
     static_assert(size <= 256, "Buffer size may not exceed 256");                // Hard limit on buffer size
     static_assert((size & (size - 1)) == 0, "Buffer size must be a power of 2");  // size must be a power of 2
+    static_assert(size >= PS2_POOL_BLOCK_SIZE, "Buffer size must be at least one pool block");
     static_assert(digitalPinToInterrupt(clkPin) != NOT_AN_INTERRUPT);
 
   protected:
+    static const bool RESEND_REPEATS_PACKET = false;
+
     volatile uint8_t head;
     volatile uint8_t tail;
-    volatile uint8_t buffer[size];
+    volatile uint8_t blocks[size / PS2_POOL_BLOCK_SIZE];    // Pool block + 1 holding each part of the buffer, 0 = none
+    uint8_t poolDevice = 0;
 
     uint8_t curCode;
     byte parity;
     byte rxBitCount;
-    uint32_t lastBitMillis;
+    volatile uint16_t idleTicks;      // Timer ticks since the last clock edge, saturates at SCANCODE_TIMEOUT_TICKS
+    uint8_t resendCount;
+    volatile bool resending = false;
 
     volatile uint8_t ps2ddr;
-    volatile uint8_t outputBuffer[2];
+    volatile uint8_t outputBuffer[PS2_CMD_SIZE];
     volatile uint8_t outputSize = 0;
+    volatile uint8_t outputIndex = 0;     // Byte of outputBuffer, or of ps2HostSeq.data while capturing, being sent
+    volatile uint8_t outputByte;          // Shift register of the byte being sent
+    volatile uint8_t cmdRetries = 0;
     volatile uint8_t timerCountdown;
     volatile PS2_CMD_STATUS commandStatus = PS2_CMD_STATUS::IDLE;
+    volatile uint8_t replyCapture = 0;    // 0 = off, 1 = host sequence being sent, 2 = until the device is silent
+    volatile uint16_t stats[PS2_STAT_COUNT];
+    volatile bool inhibited = false;
+
+    volatile uint8_t rawData[PS2_RAW_QUEUE_SIZE];
+    volatile uint8_t rawTime[PS2_RAW_QUEUE_SIZE];     // Low byte of the timer tick when each byte was received
+    volatile uint8_t rawErrors = 0;                   // Bit n set = entry n marks a dropped byte, not data
+    volatile uint8_t rawResync = 0;                   // Bit n set = entry n doesn't continue the code before it
+    volatile bool rawGap = false;                     // Device idle, or sending again, since the last entry was added
+    volatile bool rawLost = false;                    // Bytes lost on overrun, not yet reported in the queue
+    volatile uint8_t rawHead = 0;
+    volatile uint8_t rawTail = 0;
+
+    Derived& derived() {
+      return *static_cast<Derived*>(this);
+    }
+
+    /// @brief Sends a command of the SMC itself, a host sequence being sent is given up
+    void sendCommandBytes(uint8_t cmd, uint8_t data, uint8_t len) {
+      uint8_t sreg = SREG;
+      cli();
+      endHostSequence();
+      outputBuffer[0] = cmd;
+      outputBuffer[1] = data;
+      startSending(len, 0);
+      SREG = sreg;
+    }
+
+    /// @brief Starts sending outputSize bytes. Must be called with interrupts disabled.
+    void startSending(uint8_t len, uint8_t capture) {
+      commandStatus = PS2_CMD_STATUS::CMD_PENDING;        //Command pending
+      resending = false;
+      outputSize = len;        //Output buffer size
+      outputIndex = 0;
+      cmdRetries = 0;
+      replyCapture = capture;
+      sendNextByte();
+    }
+
+    /// @brief Lets the other port use ps2HostSeq once this port is done sending its host sequence
+    void endHostSequence() {
+      if (replyCapture == 1) ps2HostSeq.sending = false;
+    }
 
     void resetReceiver() {
-      resetInput();
+      derived().resetInput();
+      endHostSequence();
       outputSize = 0;
+      outputIndex = 0;
+      replyCapture = 0;
       timerCountdown = 0;
-      flush();
+      resending = false;
+      rawHead = rawTail = 0;
+      rawGap = false;
+      rawLost = false;
+      derived().flush();
     };
 
-    virtual void resetInput() {
+    /// @brief Adds a received byte, or a dropped byte if error is true, to the raw queue
+    /// @attention This is interrupt code
+    void pushRaw(uint8_t value, bool error) {
+      if (rawLost) {
+        // The decoder must not take the bytes around the gap as one code,
+        // so the lost bytes are reported ahead of this one
+        if (!storeRaw(0, true)) {
+          countStat(PS2_STAT_OVERRUN);
+          return;
+        }
+        rawLost = false;
+      }
+      if (!storeRaw(value, error)) {
+        countStat(PS2_STAT_OVERRUN);
+        rawLost = true;
+      }
+    }
+
+    /// @brief Stores an entry in the raw queue, returns false if it's full
+    bool storeRaw(uint8_t value, bool error) {
+      uint8_t headNext = (rawHead + 1) & (PS2_RAW_QUEUE_SIZE - 1);
+      if (headNext == rawTail) return false;
+      rawData[rawHead] = value;
+      rawTime[rawHead] = timerTicks;
+      if (error) rawErrors |= 1 << rawHead;
+      else rawErrors &= ~(1 << rawHead);
+      if (rawGap) rawResync |= 1 << rawHead;
+      else rawResync &= ~(1 << rawHead);
+      rawGap = false;
+      rawHead = headNext;
+      return true;
+    }
+
+    void resetInput() {
       if (PWR_ON_active()) {
         gpio_inputWithPullup(datPin);
         gpio_inputWithPullup(clkPin);
@@ -89,13 +306,17 @@ class PS2Port
 
   public:
     PS2Port() :
-      head(0), tail(0), curCode(0), parity(0), lastBitMillis(0), rxBitCount(0), ps2ddr(0), timerCountdown(0)
+      head(0), tail(0), curCode(0), parity(0), idleTicks(0), resendCount(0), rxBitCount(0), ps2ddr(0), timerCountdown(0)
     {
-      resetReceiver();
+      // The device class is not constructed yet, only the port is reset
+      PS2Port::resetInput();
+      PS2Port::flush();
     };
 
     /// @brief Begin processing PS/2 traffic
-    void begin(void(*irqFunc)()) {
+    /// @param device The device's quota in ps2Pool, PS2_POOL_KEYBOARD or PS2_POOL_MOUSE
+    void begin(void(*irqFunc)(), uint8_t device) {
+      poolDevice = device;
       attachInterrupt(digitalPinToInterrupt(clkPin), irqFunc, FALLING);
     }
 
@@ -110,13 +331,29 @@ class PS2Port
 
     void receiveBit()
     {
-      uint32_t curMillis = millis();
-      if (curMillis >= (lastBitMillis + SCANCODE_TIMEOUT_MS))
+      if (replyCapture == 2 && rxBitCount == 0 && idleTicks > REPLY_TIMEOUT_TICKS)
       {
-        // Haven't heard from device in a while, assume this is a new keycode
-        resetInput();
+        // The reply to the last command sequence is complete
+        replyCapture = 0;
       }
-      lastBitMillis = curMillis;
+
+      if (idleTicks >= SCANCODE_TIMEOUT_TICKS)
+      {
+        // Haven't heard from device in a while, assume this is a new keycode.
+        // Earlier bytes may still wait in the raw queue, so the decoder is reset
+        // when it reaches the next byte.
+        PS2Port::resetInput();
+        rawGap = true;
+      }
+      else if (rxBitCount != 0 && idleTicks > BIT_TIMEOUT_TICKS)
+      {
+        // Clock edge missed within a frame, start over with this bit
+        countStat(PS2_STAT_FRAMING_ERR);
+        curCode = 0;
+        parity = 0;
+        rxBitCount = 0;
+      }
+      idleTicks = 0;
 
       byte curBit = digitalRead_opt(datPin);
       switch (rxBitCount)
@@ -126,7 +363,11 @@ class PS2Port
           if (curBit == 0)
           {
             rxBitCount++;
-          } // else Protocol error - no start bit
+          }
+          else {
+            // Protocol error - no start bit
+            countStat(PS2_STAT_FRAMING_ERR);
+          }
           break;
 
         case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
@@ -143,43 +384,88 @@ class PS2Port
 
         case 10:
           // stop bit
+          countStat(PS2_STAT_RX_BYTES);
+          bool valid = true;
           if (curBit != 1) {
             // Protocol Error - no stop bit
+            countStat(PS2_STAT_FRAMING_ERR);
+            valid = false;
           }
           else if ((parity & 0x1) != 1) {
             // Protocol Error - parity mismatch
+            countStat(PS2_STAT_PARITY_ERR);
+            valid = false;
+          }
+
+          rxBitCount = 0;
+          parity = 0;
+
+          if (!valid) {
+            // Ask the device to send the byte again, or drop it if that has failed too many times
+            if (resendCount < MAX_RESENDS && timerCountdown == 0) {
+              resendCount++;
+              // The decoder starts over if the bytes before this one are sent again
+              if (Derived::RESEND_REPEATS_PACKET) rawGap = true;
+              requestResend();
+            }
+            else {
+              resendCount = 0;
+              pushRaw(0, true);
+            }
+            curCode = 0;
+            break;
           }
+          resendCount = 0;
 
           bool suppress_scancode = false;
           //Host to device command response handler
           if (commandStatus == PS2_CMD_STATUS::CMD_PENDING) {
             if (curCode == PS2_CMD_STATUS::CMD_ERR) {
-              //Command error - Resend
-              commandStatus = PS2_CMD_STATUS::CMD_ERR;
+              if (cmdRetries < MAX_CMD_RETRIES) {
+                //Device asks for the byte again
+                cmdRetries++;
+                sendNextByte();
+                suppress_scancode = true;
+              }
+              else {
+                //Command error
+                commandStatus = PS2_CMD_STATUS::CMD_ERR;
+                endHostSequence();
+                if (replyCapture) replyCapture = 2;
+              }
             }
             else if (curCode == PS2_CMD_STATUS::CMD_ACK) {
-              if (outputSize == 2) {
-                //Send second byte
-                sendPS2Command(outputBuffer[1]);
+              if (outputIndex + 1 < outputSize) {
+                //Send next byte of the sequence
+                outputIndex++;
+                cmdRetries = 0;
+                sendNextByte();
                 suppress_scancode = true;
               }
               else {
                 //Command ACK
                 commandStatus = PS2_CMD_STATUS::CMD_ACK;
+                endHostSequence();
+                if (replyCapture) replyCapture = 2;
               }
             }
           }
 
-          if (!suppress_scancode)
-          {
-            //Update input buffer
-            processByteReceived(curCode);
+          if (suppress_scancode) {
+            //ACK of a byte within a sequence
+          }
+          else if (replyCapture) {
+            //Reply to a command sequence, kept for the host
+            if (ps2HostSeq.owner == poolDevice && ps2HostSeq.replySize < PS2_REPLY_SIZE) {
+              ps2HostSeq.reply[ps2HostSeq.replySize++] = curCode;
+            }
+          }
+          else {
+            //Decoded in the main loop
+            pushRaw(curCode, false);
           }
-          //Else Ring buffer overrun, drop the incoming code :(
           DBG_PRINT("keycode: ");
           DBG_PRINTLN((byte)(curCode), HEX);
-          rxBitCount = 0;
-          parity = 0;
           curCode = 0;
           break;
       }
@@ -194,6 +480,7 @@ class PS2Port
         //Ignore clock transitions during the request-to-send
         return;
       }
+      idleTicks = 0;
 
 
       switch (rxBitCount)
@@ -207,7 +494,7 @@ class PS2Port
         case 6:
         case 7:
           //Output data bits 0-7
-          if (outputBuffer[0] & 1) {
+          if (outputByte & 1) {
             gpio_inputWithPullup(datPin);
           }
           else {
@@ -215,10 +502,10 @@ class PS2Port
           }
 
           //Update parity
-          parity = parity + outputBuffer[0];
+          parity = parity + outputByte;
 
           //Right shift output value - always sending the rightmost bit
-          outputBuffer[0] = (outputBuffer[0] >> 1);
+          outputByte = (outputByte >> 1);
 
           //Prepare for next clock cycle
           rxBitCount++;
@@ -245,30 +532,101 @@ class PS2Port
 
         case 10:
           //ACK
-          resetInput();    //Prepare host to receive device ACK or Resend (error) code
+          if (resending) {
+            //Prepare host to receive the byte again, keeping the state of a multi-byte code
+            resending = false;
+            PS2Port::resetInput();
+          }
+          else {
+            derived().resetInput();    //Prepare host to receive device ACK or Resend (error) code
+          }
           break;
       }
     }
 
+    /// @brief Returns true if a received byte is waiting to be decoded
+    bool rawAvailable() {
+      return rawHead != rawTail;
+    }
+
+    /// @brief Timer tick when the next byte to be decoded was received. Only the low byte
+    /// is stored, which is enough as the main loop decodes the bytes well within 25 ms.
+    /// @attention Must be called with interrupts disabled
+    uint16_t rawTimestamp() {
+      return timerTicks - (uint8_t)((uint8_t)timerTicks - rawTime[rawTail]);
+    }
+
+    /**
+       Decodes the next byte from the raw queue, adding to the input buffer.
+       Called from the main loop, with interrupts disabled.
+    */
+    void decodeNext() {
+      uint8_t i = rawTail;
+      rawTail = (i + 1) & (PS2_RAW_QUEUE_SIZE - 1);
+      if (rawResync & (1 << i)) {
+        // Starts a new code after a pause, or a packet sent again
+        derived().restartCode();
+      }
+      if (rawErrors & (1 << i)) {
+        derived().receiveError();
+      }
+      else {
+        derived().processByteReceived(rawData[i]);
+      }
+    }
+
     /// @brief Returns true if at least one byte is available from the PS/2 port
     inline bool available() {
       return head != tail;
     };
 
+    /// @brief Returns the next available byte without removing it from the buffer
+    inline uint8_t peek() {
+      return available() ? at(tail) : 0;
+    };
+
     /// @brief Returns the next available byte from the PS/2 port
-    virtual uint8_t next() {
+    uint8_t next() {
+      uint8_t value = 0;
+      uint8_t sreg = SREG;
+      cli();
       if (available()) {
-        uint8_t value = buffer[tail];
+        value = at(tail);
+        uint8_t slot = tail / PS2_POOL_BLOCK_SIZE;
         tail = (tail + 1) & (size - 1);
-        return value;
-      }
-      else {
-        return 0;
+
+        // Return the block when it has been read, or when the buffer is empty
+        if (tail == head || ((tail & (PS2_POOL_BLOCK_SIZE - 1)) == 0 && head / PS2_POOL_BLOCK_SIZE != slot)) {
+          releaseBlock(slot);
+        }
       }
+      SREG = sreg;
+      return value;
     }
 
-    virtual void flush() {
+    void flush() {
+      uint8_t sreg = SREG;
+      cli();
+      for (uint8_t i = 0; i < size / PS2_POOL_BLOCK_SIZE; i++) {
+        releaseBlock(i);
+      }
       head = tail = 0;
+      SREG = sreg;
+    }
+
+    /// @brief Drops the bytes received but not yet decoded
+    void flushRaw() {
+      uint8_t sreg = SREG;
+      cli();
+      rawTail = rawHead;
+      rawGap = false;
+      rawLost = false;
+      SREG = sreg;
+    }
+
+    /// @brief Number of pool blocks used by the buffer
+    uint8_t blockCount() {
+      return ps2Pool.blocksUsed(poolDevice);
     }
 
     void reset() {
@@ -280,12 +638,7 @@ class PS2Port
        Sends a command to the PS/2 device
     */
     void sendPS2Command(uint8_t cmd) {
-      commandStatus = PS2_CMD_STATUS::CMD_PENDING;        //Command pending
-      outputBuffer[0] = cmd;    //Fill output buffer
-      outputBuffer[1] = 0;
-      outputSize = 1;        //Output buffer size
-
-      timerCountdown = 3;       //Will determine clock hold time for the request-to-send initiated in the timer 1 interrupt handler
+      sendCommandBytes(cmd, 0, 1);
     }
 
     /**
@@ -295,18 +648,108 @@ class PS2Port
        data  - Second byte, typically a command parameter
     */
     void sendPS2Command(uint8_t cmd, uint8_t data) {
-      commandStatus = PS2_CMD_STATUS::CMD_PENDING;        //Command pending
-      outputBuffer[0] = cmd;    //Fill output buffer
-      outputBuffer[1] = data;
-      outputSize = 2;        //Output buffer size
+      sendCommandBytes(cmd, data, 2);
+    }
+
+    /**
+       Sends a sequence of command and data bytes from the host to the PS/2 device.
+       Each byte is sent when the previous one has been acknowledged,
+       and sent again if the device answers Resend. Bytes received from the
+       device until it's been silent for REPLY_TIMEOUT_TICKS after the last ACK
+       are kept in the reply buffer instead of the input buffer.
+
+       seq     - Bytes to send, at most PS2_TX_QUEUE_SIZE
 
+       The sequence and its reply are kept in ps2HostSeq, which is shared by
+       the ports. If the other port is still sending its sequence, nothing
+       is sent and the command status is set to CMD_ERR.
+    */
+    void sendPS2Sequence(const uint8_t *seq, uint8_t len) {
+      if (len == 0) return;
+      if (len > PS2_TX_QUEUE_SIZE) len = PS2_TX_QUEUE_SIZE;
+
+      uint8_t sreg = SREG;
+      cli();
+      if (ps2HostSeq.sending && ps2HostSeq.owner != poolDevice) {
+        commandStatus = PS2_CMD_STATUS::CMD_ERR;
+        SREG = sreg;
+        return;
+      }
+      for (uint8_t i = 0; i < len; i++) {
+        ps2HostSeq.data[i] = seq[i];
+      }
+      ps2HostSeq.replySize = 0;
+      ps2HostSeq.owner = poolDevice;
+      ps2HostSeq.sending = true;
+      startSending(len, 1);
+      SREG = sreg;
+    }
+
+    /// @brief Starts sending outputBuffer[outputIndex], or ps2HostSeq.data[outputIndex] for a host sequence
+    void sendNextByte() {
+      outputByte = replyCapture ? ps2HostSeq.data[outputIndex] : outputBuffer[outputIndex];
       timerCountdown = 3;       //Will determine clock hold time for the request-to-send initiated in the timer 1 interrupt handler
     }
 
+    /**
+       Sends Resend to the PS/2 device, which then sends its last
+       byte again. The status of a pending command is not changed, and
+       the rest of a command sequence is kept.
+    */
+    void requestResend() {
+      outputByte = PS2_RESEND;
+      resending = true;
+      timerCountdown = 3;
+    }
+
     PS2_CMD_STATUS getCommandStatus() {
       return commandStatus;
     }
 
+    /// @brief Sets the status of a timed out command back to idle
+    void clearCommandTimeout() {
+      uint8_t sreg = SREG;
+      cli();
+      if (commandStatus == PS2_CMD_STATUS::CMD_TIMEOUT) commandStatus = PS2_CMD_STATUS::IDLE;
+      SREG = sreg;
+    }
+
+    /// @brief Number of reply bytes kept from the last command sequence
+    uint8_t getReplySize() {
+      return ps2HostSeq.owner == poolDevice ? ps2HostSeq.replySize : 0;
+    }
+
+    uint8_t getReply(uint8_t index) {
+      return ps2HostSeq.reply[index];
+    }
+
+    /**
+       Holds the clock line low, which makes the device buffer
+       its data. A byte being received is discarded, and the device
+       sends it again when the clock is released.
+       Does nothing while sending to the device or while the
+       system is powered off. Must be called with interrupts disabled.
+    */
+    void inhibit() {
+      if (PWR_ON_active() && ps2ddr == 0 && timerCountdown == 0) {
+        gpio_driveLow(clkPin);
+        curCode = 0;
+        parity = 0;
+        rxBitCount = 0;
+        inhibited = true;
+      }
+    }
+
+    /**
+       Releases the clock line after inhibit()
+    */
+    void uninhibit() {
+      if (inhibited) {
+        inhibited = false;
+        gpio_inputWithPullup(clkPin);
+      }
+    }
+
     /*
        The timerInterrupt is made to be called by the Arduino
        timer interrupt handler once every 100 us. It
@@ -314,8 +757,12 @@ class PS2Port
        a PS/2 device
     */
     void timerInterrupt() {
+      if (idleTicks < SCANCODE_TIMEOUT_TICKS) idleTicks++;
+
       if (timerCountdown == 0x00) {
         //The host is currently sending or receiving, no operation required
+        //unless the device has stopped clocking in the byte being sent
+        if (ps2ddr != 0 && idleTicks >= SEND_TIMEOUT_TICKS) sendTimeout();
         return;
       }
 
@@ -335,6 +782,7 @@ class PS2Port
         timerCountdown = 0;
         rxBitCount = 0;
         parity = 0;
+        idleTicks = 0;
       }
 
       else {
@@ -342,11 +790,90 @@ class PS2Port
       }
     }
 
+    /**
+       Gives up sending when the device doesn't clock in the byte, as when
+       nothing is connected to the port. The lines are released and the
+       rest of the command sequence is dropped.
+       @attention This is interrupt code
+    */
+    void sendTimeout() {
+      PS2Port::resetInput();
+      endHostSequence();
+      outputSize = 0;
+      outputIndex = 0;
+      replyCapture = 0;
+      resending = false;
+      commandStatus = PS2_CMD_STATUS::CMD_TIMEOUT;
+    }
+
     uint8_t count() {
       return (size + head - tail) & (size - 1);
     }
 
-    virtual void processByteReceived(uint8_t value) {
+    /// @brief Returns the buffer byte at a position between tail and head
+    volatile uint8_t& at(uint8_t pos) {
+      return ps2Pool.data[blocks[pos / PS2_POOL_BLOCK_SIZE] - 1][pos & (PS2_POOL_BLOCK_SIZE - 1)];
+    }
+
+    /**
+       Adds a byte to head of buffer, taking a new block from the pool if needed
+       Returns true if successful, else false (if the buffer was full)
+       Must be called with interrupts disabled
+    */
+    bool put(uint8_t value) {
+      byte headNext = (head + 1) & (size - 1);
+      if (headNext == tail) return false;
+
+      uint8_t slot = head / PS2_POOL_BLOCK_SIZE;
+      if (blocks[slot] == 0) {
+        blocks[slot] = ps2Pool.alloc(poolDevice);
+        if (blocks[slot] == 0) return false;
+      }
+
+      at(head) = value;
+      head = headNext;
+      return true;
+    }
+
+    /// @brief Returns true if n bytes (at most one block) can be added to the buffer
+    bool hasRoom(uint8_t n) {
+      if (count() + n >= size) return false;
+      uint8_t slot = head / PS2_POOL_BLOCK_SIZE;
+      uint8_t left = blocks[slot] ? PS2_POOL_BLOCK_SIZE - (head & (PS2_POOL_BLOCK_SIZE - 1)) : 0;
+      return left >= n || ps2Pool.canAlloc(poolDevice);
+    }
+
+    void releaseBlock(uint8_t slot) {
+      if (blocks[slot] != 0) {
+        ps2Pool.release(poolDevice, blocks[slot]);
+        blocks[slot] = 0;
+      }
+    }
+
+    /// @brief Increments a performance or error counter, saturating at 0xffff
+    void countStat(uint8_t index) {
+      if (stats[index] != 0xffff) stats[index]++;
+    }
+
+    uint16_t getStat(uint8_t index) {
+      return stats[index];
+    }
+
+    void clearStats() {
+      for (uint8_t i = 0; i < PS2_STAT_COUNT; i++) {
+        stats[i] = 0;
+      }
+    }
+
+    void processByteReceived(uint8_t value) {
+    }
+
+    /// @brief Called when a byte is dropped after failed resend requests, or bytes are lost on overrun
+    void receiveError() {
+    }
+
+    /// @brief Called before a byte that starts over, after a pause or when the device sends its last packet again
+    void restartCode() {
     }
 };
 
@@ -382,9 +909,105 @@ const uint8_t PS2_REG_SCANCODES[] PROGMEM = {
   0, 0, 118
 };
 
+// Conversion table: PS/2 Set 2 extended scan codes (after 0xe0) to IBM System/2 key numbers,
+// generated at compile time for the range PS2_EXT_FIRST to PS2_EXT_LAST
+#define PS2_EXT_FIRST 0x11
+#define PS2_EXT_LAST  0x7d
+
+struct PS2ExtScancodes {
+  uint8_t keycode[PS2_EXT_LAST - PS2_EXT_FIRST + 1];
+
+  constexpr PS2ExtScancodes() : keycode() {
+    map(0x11, 62);    // Right Alt
+    map(0x14, 64);    // Right Ctrl
+    map(0x1f, 59);    // Left GUI
+    map(0x27, 63);    // Right GUI
+    map(0x2f, 65);    // Menu key
+    map(0x69, 81);    // End
+    map(0x70, 75);    // Insert
+    map(0x71, 76);    // Delete
+    map(0x6b, 79);    // Left arrow
+    map(0x6c, 80);    // Home
+    map(0x75, 83);    // Up arrow
+    map(0x72, 84);    // Down arrow
+    map(0x7d, 85);    // Page up
+    map(0x7a, 86);    // Page down
+    map(0x74, 89);    // Right arrow
+    map(0x4a, 95);    // KP divide
+    map(0x5a, 108);   // KP enter
+    map(0x7c, 124);   // KP PrtScr
+    map(0x15, 126);   // Pause/Break
+  }
+
+  constexpr void map(uint8_t scancode, uint8_t key) {
+    keycode[scancode - PS2_EXT_FIRST] = key;
+  }
+};
+
+const PS2ExtScancodes PS2_EXT_SCANCODES PROGMEM;
+
+// Conversion table: PS/2 Set 3 scan codes to IBM System/2 key numbers
+// Set 3 is used with all keys in typematic/make/break mode; there are no prefixed codes
+const uint8_t PS2_SET3_SCANCODES[] PROGMEM = {
+  0, 0, 0, 0, 0, 0, 112, 110,
+  0, 0, 0, 0, 16, 1, 113, 0,
+  58, 44, 45, 30, 17, 2, 114, 0,
+  60, 46, 32, 31, 18, 3, 115, 0,
+  48, 47, 33, 19, 5, 4, 116, 0,
+  61, 49, 34, 21, 20, 6, 117, 0,
+  51, 50, 36, 35, 22, 7, 118, 0,
+  62, 52, 37, 23, 8, 9, 119, 0,
+  53, 38, 24, 25, 11, 10, 120, 0,
+  54, 55, 39, 40, 26, 12, 121, 0,
+  0, 41, 42, 27, 13, 122, 124, 64,
+  57, 43, 28, 29, 0, 123, 125, 84,
+  79, 126, 83, 76, 81, 15, 75, 0,
+  93, 89, 92, 91, 86, 80, 85, 99,
+  104, 98, 97, 102, 96, 90, 95, 0,
+  108, 103, 0, 106, 101, 100, 0, 0,
+  0, 0, 0, 105, 0, 0, 0, 0,
+  0, 0, 59, 63, 65
+};
+
+// Typematic (key repeat) handling
+enum PS2_TYPEMATIC_MODE : uint8_t {
+  TYPEMATIC_PASS = 0,         // Repeats sent by the keyboard are stored as key codes
+  TYPEMATIC_SUPPRESS = 1,     // Repeats sent by the keyboard are dropped
+  TYPEMATIC_GENERATE = 2,     // Repeats sent by the keyboard are dropped, the SMC generates repeats at the configured delay and rate
+  TYPEMATIC_COUNT = 3         // Repeats are reported as one record: TYPEMATIC_RECORD, key code, number of repeats
+};
+
+enum PS2_TYPEMATIC_PARAM : uint8_t {
+  TYPEMATIC_PARAM_MODE = 0,
+  TYPEMATIC_PARAM_DELAY,      // Delay before the first generated repeat, in main loop ticks (about 10 ms)
+  TYPEMATIC_PARAM_RATE,       // Time between generated repeats, in main loop ticks
+  TYPEMATIC_PARAM_COUNT
+};
+
+#define TYPEMATIC_RECORD          0x7f    // Not a valid key number
+#define TYPEMATIC_DEFAULT_DELAY   50
+#define TYPEMATIC_DEFAULT_RATE    3
+#define TYPEMATIC_LOST_TICKS      120     // Main loop ticks without a repeat from the keyboard after which a held key is taken as released
+
+#define KEY_MAP_SIZE              16      // Bytes in the key-down bitmap, one bit per IBM key number
+
+// Track which keys have gone down or up between reads, readable at I2C offset 0x4c.
+// Takes another KEY_MAP_SIZE bytes of RAM.
+//#define ENABLE_KEYS_CHANGED
+
+// Key remap table in EEPROM: byte N holds the key number that key N is translated to,
+// 0x00 or 0xff (erased) = not remapped
+#define KEY_REMAP_EEPROM_ADDR     0
+#define KEY_REMAP_SIZE            128
+#define KEY_REMAP_MAX_KEY         0x7e    // Highest key number an entry may hold, 0x7f is TYPEMATIC_RECORD
+#define KEY_REMAP_NONE            0xff    // Entry value of a key that is not remapped, erased EEPROM
+
 template<uint8_t clkPin, uint8_t datPin, uint8_t size>
-class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
+class PS2KeyboardPort : public PS2Port<clkPin, datPin, size, PS2KeyboardPort<clkPin, datPin, size>>
 {
+  typedef PS2Port<clkPin, datPin, size, PS2KeyboardPort> Base;
+  friend Base;
+
   /*
    * This class transforms PS/2 keyboard scan codes to 
    * IBM System/2 key numbers. The IBM key numbers are stored
@@ -420,6 +1043,16 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
     volatile bool nmi_request = false;
     uint8_t modifier_key_codes[8] = {60, 44, 58, 57, 62, 64, 59, 63}; // IBM PS/2 key numbers for left Alt, left Shift, left Control, right Shift, right Alt, right Control, left Win and right Win
     volatile uint8_t bat = 0;
+    volatile uint8_t scancode_set = 2;          // Scan code set the keyboard is using, 2 or 3
+    volatile uint8_t typematic[TYPEMATIC_PARAM_COUNT] = {TYPEMATIC_PASS, TYPEMATIC_DEFAULT_DELAY, TYPEMATIC_DEFAULT_RATE};
+    volatile uint8_t typematic_key = 0;         // Last key pressed and still held down, the key that repeats
+    volatile uint8_t typematic_timer = 0;       // Main loop ticks until the next generated repeat
+    volatile uint8_t typematic_silence = 0;     // Main loop ticks since the keyboard last sent the held key
+    volatile uint8_t repeat_count = 0;          // Repeats not yet reported, TYPEMATIC_COUNT mode
+    volatile uint8_t keys_down[KEY_MAP_SIZE];   // Bit (key & 7) of byte (key >> 3) set while the key is held down
+#if defined(ENABLE_KEYS_CHANGED)
+    volatile uint8_t keys_changed[KEY_MAP_SIZE];  // Keys that have gone down or up since takeKeysChanged()
+#endif
 
     /// @brief Converts a PS/2 Set 2 scan code to a IBM System/2 key number
     /// @param scancode A one-byte scan code in the range 1 to 132; no extended scan codes
@@ -435,47 +1068,42 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
     /// @brief Converts a PS/2 Set 2 extended scan code to a IBM System/2 key number
     /// @param scancode The second byte of an extended scan code (after 0xe0)
     uint8_t ps2ext_to_keycode(uint8_t scancode) {
-      switch (scancode) {
-        case 0x11:  // Right Alt
-          return 62;
-        case 0x14:  // Right Ctrl
-          return 64;
-        case 0x1f:  // Left GUI
-          return 59;
-        case 0x27:  // Right GUI
-          return 63;
-        case 0x2f:  // Menu key
-          return 65;
-        case 0x69:  // End
-          return 81;
-        case 0x70:  // Insert
-          return 75;
-        case 0x71:  // Delete
-          return 76;
-        case 0x6b:  // Left arrow
-          return 79;
-        case 0x6c:  // Home
-          return 80;
-        case 0x75:  // Up arrow
-          return 83;
-        case 0x72:  // Down arrow
-          return 84;
-        case 0x7d:  // Page up
-          return 85;
-        case 0x7a:  // Page down
-          return 86;
-        case 0x74:  // Right arrow
-          return 89;
-        case 0x4a:  // KP divide
-          return 95;
-        case 0x5a:  // KP enter
-          return 108;
-        case 0x7c:  // KP PrtScr
-          return 124;
-        case 0x15:  // Pause/Break
-          return 126;
+      if (scancode >= PS2_EXT_FIRST && scancode <= PS2_EXT_LAST) {
+        return pgm_read_byte(&(PS2_EXT_SCANCODES.keycode[scancode - PS2_EXT_FIRST]));
+      }
+      else {
+        return 0;
+      }
+    }
+
+    /// @brief Converts a PS/2 Set 3 scan code to a IBM System/2 key number
+    uint8_t ps2set3_to_keycode(uint8_t scancode) {
+      if (scancode > 0 && scancode <= sizeof(PS2_SET3_SCANCODES)) {
+        return pgm_read_byte(&(PS2_SET3_SCANCODES[scancode - 1]));
+      }
+      else {
+        return 0;
       }
-      return 0;
+    }
+
+  public:
+    /// @brief Translates a key number with the remap table in EEPROM
+    /// @attention Waits if the EEPROM is being written
+    uint8_t remapKey(uint8_t key) {
+      if (key == 0) return 0;
+      uint8_t value = eeprom_read_byte((const uint8_t *)(KEY_REMAP_EEPROM_ADDR + (key & 0x7f)));
+      return (value == 0 || value > KEY_REMAP_MAX_KEY) ? key : value;
+    }
+
+  protected:
+    /// @brief Converts a scan code and applies the remap table, see ps2_to_keycode()
+    uint8_t ps2_to_key(uint8_t scancode) {
+      return remapKey(ps2_to_keycode(scancode));
+    }
+
+    /// @brief Converts an extended scan code and applies the remap table, see ps2ext_to_keycode()
+    uint8_t ps2ext_to_key(uint8_t scancode) {
+      return remapKey(ps2ext_to_keycode(scancode));
     }
 
   public:
@@ -487,12 +1115,65 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
       bat = 0; 
     }
 
+    uint8_t getScanCodeSet() {
+      return scancode_set;
+    }
+
+    uint8_t getTypematic(uint8_t param) {
+      return typematic[param];
+    }
+
+    void setTypematic(uint8_t param, uint8_t value) {
+      if (param == TYPEMATIC_PARAM_MODE) {
+        if (value > TYPEMATIC_COUNT) return;
+        putRepeats();
+      }
+      else if (value == 0) {
+        value = 1;
+      }
+      typematic[param] = value;
+    }
+
+    void resetTypematic() {
+      setTypematic(TYPEMATIC_PARAM_MODE, TYPEMATIC_PASS);
+      setTypematic(TYPEMATIC_PARAM_DELAY, TYPEMATIC_DEFAULT_DELAY);
+      setTypematic(TYPEMATIC_PARAM_RATE, TYPEMATIC_DEFAULT_RATE);
+    }
+
+    /**
+       Generates key repeats in TYPEMATIC_GENERATE mode. A repeat is only
+       stored when the host has read all key codes; otherwise it's skipped.
+       Called once per main loop iteration, with interrupts disabled.
+    */
+    void typematicTick() {
+      if (typematic[TYPEMATIC_PARAM_MODE] != TYPEMATIC_GENERATE || typematic_key == 0) return;
+
+      // The keyboard repeats the held key too. If it stops, the key up code
+      // was lost or the keyboard unplugged, and the key is no longer repeated.
+      if (++typematic_silence >= TYPEMATIC_LOST_TICKS) {
+        typematic_key = 0;
+        return;
+      }
+
+      if (--typematic_timer == 0) {
+        if (!this->available()) storeKey(typematic_key);
+        typematic_timer = typematic[TYPEMATIC_PARAM_RATE];
+      }
+    }
+
+    /// @brief Selects how received scan codes are interpreted; the keyboard must be switched separately
+    void setScanCodeSet(uint8_t set) {
+      scancode_set = set;
+      scancode_state = 0;
+    }
+
     /**
        Processes a scan code byte received from the keyboard
     */
     void processByteReceived(uint8_t value) {
-      // Handle BAT success (0xaa) or fail (0xfc) code
-      if (getKeyboardState() != KBD_STATE_READY && (value == 0xaa || value == 0xfc)) {
+      // Handle BAT success (0xaa) or fail (0xfc) code. Once ready, a BAT code
+      // between scan codes means that a keyboard was plugged in
+      if ((!keyboardIsReady() || scancode_state == 0) && (value == 0xaa || value == 0xfc)) {
         bat = value;
         return;
       }
@@ -507,7 +1188,8 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
       }
 
       // Update scancode state and add key code to input buffer
-      updateState(value);
+      if (scancode_set == 3) updateStateSet3(value);
+      else updateState(value);
 
       // buffer_overrun not set means that there are no modifier key state changes to track; set oldstate = state
       if (!buffer_overrun) {
@@ -528,31 +1210,25 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
           else if (value == 0xab) scancode_state = 0x51;  // Start of two byte response to read ID command
           else if (value == 0xe0) scancode_state = 0x21;  // Start of extended code
           else if (value == 0xe1) scancode_state = 0x41;  // Start of Pause key code
-          else if (!buffer_overrun && value < 0xf0) bufferAdd(ps2_to_keycode(value));
-
-          // Update modifier key status
-          if (value == 0x12) modifier_state |= PS2_MODIFIER_STATE::LSHIFT;
-          else if (value == 0x59) modifier_state |= PS2_MODIFIER_STATE::RSHIFT;
-          else if (value == 0x14) modifier_state |= PS2_MODIFIER_STATE::LCTRL;
-          else if (value == 0x11) modifier_state |= PS2_MODIFIER_STATE::LALT;
+          else if (value < 0xf0) {
+            uint8_t key = ps2_to_key(value);
+            putKey(key);
+            updateModifiers(key, true);
+          }
 
           // Check Ctrl+Alt+PrtScr/Restore => NMI
-          else if (value == 0x84 && isCtrlAltDown()) nmi_request = true;
+          if (value == 0x84 && isCtrlAltDown()) nmi_request = true;
 
           break;
 
         case 0x11:    // After 0xf0 (break code)
           // Update state
           scancode_state = 0x00;
-
-          // Update modifier key status
-          if (value == 0x12) modifier_state &= ~PS2_MODIFIER_STATE::LSHIFT;
-          else if (value == 0x59) modifier_state &= ~PS2_MODIFIER_STATE::RSHIFT;
-          else if (value == 0x14) modifier_state &= ~PS2_MODIFIER_STATE::LCTRL;
-          else if (value == 0x11) modifier_state &= ~PS2_MODIFIER_STATE::LALT;
-
-          if (!buffer_overrun) bufferAdd(ps2_to_keycode(value) | 0x80);
-
+          {
+            uint8_t key = ps2_to_key(value);
+            updateModifiers(key, false);
+            putKey(key | 0x80);
+          }
           break;
 
         case 0x21:    // After 0xe0 (extended code)
@@ -560,19 +1236,15 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
           if (value == 0xf0) scancode_state = 0x32; // Extended break code
           else {
             if (value != 0x12 && value != 0x59) {
-              if (!buffer_overrun) bufferAdd(ps2ext_to_keycode(value));
+              uint8_t key = ps2ext_to_key(value);
+              putKey(key);
+              updateModifiers(key, true);
             }
             scancode_state = 0x00;
           }
 
-          // Update modifier key status
-          if (value == 0x14) modifier_state |= PS2_MODIFIER_STATE::RCTRL;
-          else if (value == 0x1f) modifier_state |= PS2_MODIFIER_STATE::LWIN;
-          else if (value == 0x27) modifier_state |= PS2_MODIFIER_STATE::RWIN;
-          else if (value == 0x11) modifier_state |= PS2_MODIFIER_STATE::RALT;
-
           // Check Ctrl+Alt+Del => Reset
-          else if (value == 0x71 && isCtrlAltDown()) reset_request = true;
+          if (value == 0x71 && isCtrlAltDown()) reset_request = true;
 
           break;
 
@@ -580,15 +1252,10 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
           // Update state
           scancode_state = 0x00;
           if (value != 0x12 && value != 0x59) {
-            if (!buffer_overrun) bufferAdd(ps2ext_to_keycode(value) | 0x80);
+            uint8_t key = ps2ext_to_key(value);
+            updateModifiers(key, false);
+            putKey(key | 0x80);
           }
-
-          // Update modifier key status
-          if (value == 0x14) modifier_state &= ~PS2_MODIFIER_STATE::RCTRL;
-          else if (value == 0x1f) modifier_state &= ~PS2_MODIFIER_STATE::LWIN;
-          else if (value == 0x27) modifier_state &= ~PS2_MODIFIER_STATE::RWIN;
-          else if (value == 0x11) modifier_state &= ~PS2_MODIFIER_STATE::RALT;
-
           break;
 
         case 0x41:    // After 0xe1 (pause make code, 8 bytes)
@@ -601,7 +1268,7 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
           break;
 
         case 0x47:
-          if (!buffer_overrun) bufferAdd(126);
+          putKey(remapKey(126), true);   // Pause has no key up code in Set 2
           scancode_state = 0x00;
           break;
 
@@ -611,36 +1278,192 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
       }
     }
 
+    /**
+       State machine for Scan Code Set 3, typematic/make/break mode:
+       a make code is one byte, and a break code is 0xf0 followed by the make code
+    */
+    void updateStateSet3(uint8_t value) {
+      switch (scancode_state) {
+        case 0x00:    // Start of new scan code
+          if (value == 0xf0) scancode_state = 0x11;   // Start of break code
+          else if (value == 0xab) scancode_state = 0x51;  // Start of two byte response to read ID command
+          else {
+            uint8_t key = remapKey(ps2set3_to_keycode(value));
+            if (key) {
+              putKey(key);
+              updateModifiers(key, true);
+
+              // Check Ctrl+Alt+Del => Reset and Ctrl+Alt+PrtScr => NMI
+              if (key == 76 && isCtrlAltDown()) reset_request = true;
+              else if (key == 124 && isCtrlAltDown()) nmi_request = true;
+            }
+          }
+          break;
+
+        case 0x11:    // After 0xf0 (break code)
+          scancode_state = 0x00;
+          {
+            uint8_t key = remapKey(ps2set3_to_keycode(value));
+            if (key) {
+              putKey(key | 0x80);
+              updateModifiers(key, false);
+            }
+          }
+          break;
+
+        case 0x51:    // After 0xab (two byte response to read ID command)
+          scancode_state = 0x00;
+          break;
+      }
+    }
+
+    /// @brief Updates modifier key status from an IBM key number
+    void updateModifiers(uint8_t key, bool down) {
+      uint8_t shifted_bit = 0x01;
+      for (uint8_t i = 0; i < 8; i++) {
+        if (key == modifier_key_codes[i]) {
+          if (down) modifier_state |= shifted_bit;
+          else modifier_state &= ~shifted_bit;
+          return;
+        }
+        shifted_bit = shifted_bit << 1;
+      }
+    }
+
+    /**
+       Updates the key-down bitmap. Keys are tracked even if the
+       buffer is full. Keys without a key up code (noBreak) are never down.
+    */
+    void updateKeyMap(uint8_t keycode, bool noBreak = false) {
+      uint8_t key = keycode & 0x7f;
+      if (key == 0 || noBreak) return;
+
+      uint8_t mask = 1 << (key & 7);
+#if defined(ENABLE_KEYS_CHANGED)
+      uint8_t old = keys_down[key >> 3];
+#endif
+      if (keycode & 0x80) keys_down[key >> 3] &= ~mask;
+      else keys_down[key >> 3] |= mask;
+#if defined(ENABLE_KEYS_CHANGED)
+      keys_changed[key >> 3] |= old ^ keys_down[key >> 3];
+#endif
+    }
+
+    /**
+       Adds a key code to the buffer, unless the buffer is closed
+       because of a previous buffer overrun. noBreak is set for a key
+       that has no key up code, such as Pause in Set 2.
+    */
+    void putKey(uint8_t keycode, bool noBreak = false) {
+      updateKeyMap(keycode, noBreak);
+
+      if (keycode == 0 || noBreak) {
+        // Unknown keys and keys without a key up code don't repeat
+      }
+      else if ((keycode & 0x80) == 0) {
+        if (keycode == typematic_key) {
+          // Repeat sent by the keyboard
+          typematic_silence = 0;
+          if (typematic[TYPEMATIC_PARAM_MODE] == TYPEMATIC_PASS) {
+            storeKey(keycode);
+          }
+          else if (typematic[TYPEMATIC_PARAM_MODE] == TYPEMATIC_COUNT) {
+            repeat_count++;
+            if (repeat_count == 0xff) putRepeats();
+          }
+          return;
+        }
+        putRepeats();
+        typematic_key = keycode;
+        typematic_timer = typematic[TYPEMATIC_PARAM_DELAY];
+        typematic_silence = 0;
+      }
+      else if ((keycode & 0x7f) == typematic_key) {
+        putRepeats();
+        typematic_key = 0;
+      }
+
+      storeKey(keycode);
+    }
+
+    /**
+       Adds a key code to the buffer, unless the buffer is closed
+       because of a previous buffer overrun
+    */
+    void storeKey(uint8_t keycode) {
+      if (buffer_overrun) {
+        this->countStat(PS2_STAT_OVERRUN);
+      }
+      else {
+        bufferAdd(keycode);
+      }
+    }
+
+    /**
+       Stores the repeats counted in TYPEMATIC_COUNT mode as one record.
+       The record is dropped if there is no room for all of it.
+    */
+    void putRepeats() {
+      if (repeat_count == 0) return;
+      if (!buffer_overrun && this->hasRoom(3)) {
+        bufferAdd(TYPEMATIC_RECORD);
+        bufferAdd(typematic_key);
+        bufferAdd(repeat_count);
+      }
+      else {
+        this->countStat(PS2_STAT_OVERRUN);
+      }
+      repeat_count = 0;
+    }
+
     /**
        Adds a byte to head of buffer
        Returns true if successful, else false (if the buffer was full)
     */
     bool bufferAdd(uint8_t value) {
-      byte headNext = (this->head + 1) & (size - 1);
-      if (headNext != this->tail) {
-        this->buffer[this->head] = value;
-        this->head = headNext;
+      if (this->put(value)) {
         return true;
       }
       else {
         buffer_overrun = true;
+        this->countStat(PS2_STAT_OVERRUN);
         return false;
       }
     }
 
     /// @brief Clears the input buffer and prepares to port to receive new input
     void flush() {
-      PS2Port<clkPin, datPin, size>::flush();
+      Base::flush();
 
       scancode_state = 0;
       modifier_state = 0;
       buffer_overrun = false;
       nmi_request = false;
       reset_request = false;
+      typematic_key = 0;
+      repeat_count = 0;
+      for (uint8_t i = 0; i < KEY_MAP_SIZE; i++) {
+        keys_down[i] = 0;
+#if defined(ENABLE_KEYS_CHANGED)
+        keys_changed[i] = 0;
+#endif
+      }
     }
 
     void resetInput() {
-      PS2Port<clkPin, datPin, size>::resetInput();
+      Base::resetInput();
+      scancode_state = 0;
+    }
+
+    void receiveError() {
+      // The rest of a multi-byte scan code can't be interpreted. If it was the
+      // key up code of the held key, the key would repeat forever.
+      scancode_state = 0;
+      putRepeats();
+      typematic_key = 0;
+    }
+
+    void restartCode() {
       scancode_state = 0;
     }
 
@@ -665,6 +1488,19 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
       return true;
     }
 
+    uint8_t getKeysDown(uint8_t index) {
+      return keys_down[index];
+    }
+
+#if defined(ENABLE_KEYS_CHANGED)
+    /// @brief Returns which keys of keys_down[index] have changed since the last call, and clears them
+    uint8_t takeKeysChanged(uint8_t index) {
+      uint8_t value = keys_changed[index];
+      keys_changed[index] = 0;
+      return value;
+    }
+#endif
+
     bool getResetRequest() {
       return reset_request;
     }
@@ -689,13 +1525,48 @@ class PS2KeyboardPort : public PS2Port<clkPin, datPin, size>
     }
 };
 
+enum PS2_MOUSE_MODE : uint8_t {
+  MOUSE_MODE_PACKET = 0,      // Packets are stored in the buffer, and merged when possible
+  MOUSE_MODE_ACCUMULATE = 1   // Movement is summed up, reads return the movement since the last read
+};
+
+// A button change queued in MOUSE_MODE_ACCUMULATE, kept in a pool block of the mouse:
+// the buttons, then the X, Y and W movement before the change, low byte first
+#define MOUSE_BUTTON_ENTRY_BUTTONS 0
+#define MOUSE_BUTTON_ENTRY_X 1
+#define MOUSE_BUTTON_ENTRY_Y 3
+#define MOUSE_BUTTON_ENTRY_W 5
+static_assert(MOUSE_BUTTON_ENTRY_W + 2 <= PS2_POOL_BLOCK_SIZE, "A button change must fit in a pool block");
+
 template<uint8_t clkPin, uint8_t datPin, uint8_t size>
-class PS2MousePort : public PS2Port<clkPin, datPin, size>
+class PS2MousePort : public PS2Port<clkPin, datPin, size, PS2MousePort<clkPin, datPin, size>>
 {
+  typedef PS2Port<clkPin, datPin, size, PS2MousePort> Base;
+  friend Base;
+
   private:
+    static const bool RESEND_REPEATS_PACKET = true;
+
     volatile uint8_t newPacket[4];
     volatile uint8_t pindex = 0x00;
+    volatile bool restarted = false;          // The next byte follows a pause
+    volatile bool packetAfterPause = false;   // The packet being received started after a pause
     volatile uint8_t i0 = 0xff;
+    volatile uint8_t packetReadLeft = 0x00;
+    volatile uint8_t mode = MOUSE_MODE_PACKET;
+
+    // MOUSE_MODE_ACCUMULATE: movement since the last button change, and a queue of button
+    // changes, each with the movement up to and including the packet that changed the buttons.
+    // Button bits 0-2 are from byte 0, bits 4-5 from byte 3 (device ID 4).
+    // The packet buffer isn't used in this mode, so each queued change takes one of its
+    // blocks (slot n of the queue in blocks[n]), within the pool quota of the mouse.
+    static const uint8_t BUTTON_QUEUE_SIZE = size / PS2_POOL_BLOCK_SIZE;
+    volatile int16_t accX = 0, accY = 0, accW = 0;
+    volatile uint8_t buttons = 0;
+    volatile uint8_t reportedButtons = 0;
+    volatile uint8_t btnHead = 0;
+    volatile uint8_t btnCount = 0;
+    volatile uint8_t readPacket[4];
 
     int16_t fromInt9(uint8_t sign, uint8_t value) {
       if (sign) { 
@@ -707,15 +1578,163 @@ class PS2MousePort : public PS2Port<clkPin, datPin, size>
     }
 
     int8_t fromInt4(uint8_t value) {
-      return (int8_t)((value & 0x0f) | (value & 0xb00001000 ? 0xf0 : 0x00));
+      return (int8_t)((value & 0x0f) | (value & 0b00001000 ? 0xf0 : 0x00));
+    }
+
+    static int16_t addSaturated(int16_t acc, int16_t delta) {
+      int32_t sum = (int32_t)acc + delta;
+      if (sum > INT16_MAX) return INT16_MAX;
+      if (sum < INT16_MIN) return INT16_MIN;
+      return sum;
+    }
+
+    static int16_t clamp(int16_t value, int16_t min, int16_t max) {
+      return value < min ? min : (value > max ? max : value);
+    }
+
+    volatile uint8_t *buttonEntry(uint8_t slot) {
+      return ps2Pool.data[this->blocks[slot] - 1];
+    }
+
+    static int16_t getEntryWord(volatile uint8_t *entry, uint8_t offset) {
+      return entry[offset] | (entry[offset + 1] << 8);
+    }
+
+    static void setEntryWord(volatile uint8_t *entry, uint8_t offset, int16_t value) {
+      entry[offset] = value;
+      entry[offset + 1] = value >> 8;
+    }
+
+    bool accumulatedPending() {
+      return accX != 0 || accY != 0 || accW != 0 || buttons != reportedButtons;
+    }
+
+    /**
+       Adds a complete packet to the accumulators in MOUSE_MODE_ACCUMULATE.
+       A button change closes the movement so far and queues it with the new button state.
+    */
+    void accumulatePacket() {
+      bool pending = btnCount > 0 || accumulatedPending();
+
+      uint8_t b = newPacket[0] & 0x07;
+      if (newPacket[0] & 0b11000000) {
+        // Overflow, the movement is not valid
+        this->countStat(PS2_STAT_OVERFLOW);
+      }
+      else {
+        accX = addSaturated(accX, fromInt9(newPacket[0] & 0b00010000, newPacket[1]));
+        accY = addSaturated(accY, fromInt9(newPacket[0] & 0b00100000, newPacket[2]));
+      }
+      if (getMousePacketSize() == 4) {
+        accW = addSaturated(accW, fromInt4(newPacket[3]));
+        if (getMouseId() == 4) b |= newPacket[3] & 0x30;
+      }
+
+      if (b != buttons) {
+        buttons = b;
+
+        // Bytes left in the buffer from the mouse initialization are dropped, the blocks are used for the queue
+        if (btnCount == 0 && this->available()) Base::flush();
+
+        uint8_t i = (btnHead + btnCount) & (BUTTON_QUEUE_SIZE - 1);
+        if (btnCount < BUTTON_QUEUE_SIZE && (this->blocks[i] = ps2Pool.alloc(this->poolDevice)) != 0) {
+          volatile uint8_t *entry = buttonEntry(i);
+          entry[MOUSE_BUTTON_ENTRY_BUTTONS] = b;
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_X, accX);
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_Y, accY);
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_W, accW);
+          accX = accY = accW = 0;
+          btnCount++;
+        }
+        else if (btnCount > 0) {
+          // Queue full, the last change is replaced by this one, so that the
+          // host still gets the latest button state in order
+          volatile uint8_t *entry = buttonEntry((btnHead + btnCount - 1) & (BUTTON_QUEUE_SIZE - 1));
+          entry[MOUSE_BUTTON_ENTRY_BUTTONS] = b;
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_X, addSaturated(getEntryWord(entry, MOUSE_BUTTON_ENTRY_X), accX));
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_Y, addSaturated(getEntryWord(entry, MOUSE_BUTTON_ENTRY_Y), accY));
+          setEntryWord(entry, MOUSE_BUTTON_ENTRY_W, addSaturated(getEntryWord(entry, MOUSE_BUTTON_ENTRY_W), accW));
+          accX = accY = accW = 0;
+          this->countStat(PS2_STAT_OVERRUN);
+        }
+        else {
+          // No block free, the change is reported with the movement in the accumulators
+          this->countStat(PS2_STAT_OVERRUN);
+        }
+      }
+      else if (pending) {
+        this->countStat(PS2_STAT_COALESCED);
+      }
+    }
+
+    /**
+       Takes the next packet from the accumulators into readPacket. Movement outside the range
+       of a packet is left for the next read; a queued button change is reported with the last
+       part of the movement before it.
+    */
+    bool beginAccumulatedRead() {
+      int16_t x, y, w;
+      uint8_t b;
+      bool queued = btnCount > 0;
+      volatile uint8_t *entry = queued ? buttonEntry(btnHead) : 0;
+      if (queued) {
+        x = getEntryWord(entry, MOUSE_BUTTON_ENTRY_X);
+        y = getEntryWord(entry, MOUSE_BUTTON_ENTRY_Y);
+        w = getEntryWord(entry, MOUSE_BUTTON_ENTRY_W);
+        b = entry[MOUSE_BUTTON_ENTRY_BUTTONS];
+      }
+      else {
+        if (!accumulatedPending()) return false;
+        x = accX;
+        y = accY;
+        w = accW;
+        b = buttons;
+      }
+
+      int16_t dx = clamp(x, -256, 255);
+      int16_t dy = clamp(y, -256, 255);
+      int16_t dw = clamp(w, -8, 7);
+      x -= dx;
+      y -= dy;
+      w -= dw;
+      if (x != 0 || y != 0 || w != 0) {
+        b = reportedButtons;
+      }
+
+      if (queued) {
+        setEntryWord(entry, MOUSE_BUTTON_ENTRY_X, x);
+        setEntryWord(entry, MOUSE_BUTTON_ENTRY_Y, y);
+        setEntryWord(entry, MOUSE_BUTTON_ENTRY_W, w);
+        if (x == 0 && y == 0 && w == 0) {
+          this->releaseBlock(btnHead);
+          btnHead = (btnHead + 1) & (BUTTON_QUEUE_SIZE - 1);
+          btnCount--;
+        }
+      }
+      else {
+        accX = x;
+        accY = y;
+        accW = w;
+      }
+      reportedButtons = b;
+
+      readPacket[0] = 0b00001000 | (b & 0x07) | (dx < 0 ? 0b00010000 : 0) | (dy < 0 ? 0b00100000 : 0);
+      readPacket[1] = dx;
+      readPacket[2] = dy;
+      readPacket[3] = (dw & 0x0f) | (getMouseId() == 4 ? (b & 0x30) : (dw < 0 ? 0xf0 : 0));
+      packetReadLeft = getMousePacketSize();
+      return true;
     }
 
     bool updatePacket() {
       // Abort if no complete packet in buffer
       if (this->count() < getMousePacketSize()) return false;
 
+      // Abort if the last packet was not stored completely, or if it's being read
+      if (((this->head - i0) & (size - 1)) != getMousePacketSize() || packetReadLeft > 0) return false;
+
       // Abort if overflow set
-      if ((this->buffer[i0] | newPacket[0]) & 0b11000000) return false;
+      if ((this->at(i0) | newPacket[0]) & 0b11000000) return false;
 
       // Calculate indices to elements of packet last stored in the buffer
       uint8_t i1, i2, i3;
@@ -724,53 +1743,60 @@ class PS2MousePort : public PS2Port<clkPin, datPin, size>
       i3 = (i0 + 3) & (size - 1);
 
       // Abort if button state changed
-      if (((this->buffer[i0] ^ newPacket[0]) & 0x07)) return false;
+      if (((this->at(i0) ^ newPacket[0]) & 0x07)) return false;
 
       // Add X movements
-      int16_t deltaX = fromInt9(this->buffer[i0] & 0b00010000, this->buffer[i1]) + fromInt9(newPacket[0] & 0b00010000, newPacket[1]);
+      int16_t deltaX = fromInt9(this->at(i0) & 0b00010000, this->at(i1)) + fromInt9(newPacket[0] & 0b00010000, newPacket[1]);
       if (deltaX < -256 || deltaX > 255) return false;
 
       // Add Y movements
-      int16_t deltaY = fromInt9(this->buffer[i0] & 0b00100000, this->buffer[i2]) + fromInt9(newPacket[0] & 0b00100000, newPacket[2]);
+      int16_t deltaY = fromInt9(this->at(i0) & 0b00100000, this->at(i2)) + fromInt9(newPacket[0] & 0b00100000, newPacket[2]);
       if (deltaY < -256 || deltaY > 255) return false;
 
       // Add scroll wheel movement
       int8_t deltaW;
       if (getMousePacketSize() == 4) {
-        deltaW = fromInt4(this->buffer[i3]) + fromInt4(newPacket[3]);
+        deltaW = fromInt4(this->at(i3)) + fromInt4(newPacket[3]);
         if (deltaW < -8 || deltaW > 7) return false;
-        this->buffer[i3] = (deltaW & 0x0f) | (newPacket[3] & 0xf0);
+        this->at(i3) = (deltaW & 0x0f) | (newPacket[3] & 0xf0);
       }
 
       // Update packet
-      this->buffer[i0] = (newPacket[0] & 0x0f) | (deltaX<0? 0b00010000: 0) | (deltaY<0? 0b00100000:0);
-      this->buffer[i1] = deltaX;
-      this->buffer[i2] = deltaY;
+      this->at(i0) = (newPacket[0] & 0x0f) | (deltaX<0? 0b00010000: 0) | (deltaY<0? 0b00100000:0);
+      this->at(i1) = deltaX;
+      this->at(i2) = deltaY;
       
       return true;
     }
 
     void bufferAdd(uint8_t value) {
-      byte headNext = (this->head + 1) & (size - 1);
-      if (headNext != this->tail) {
-        this->buffer[this->head] = value;
-        this->head = headNext;
+      if (!this->put(value)) {
+        this->countStat(PS2_STAT_OVERRUN);
       }
     }
 
   protected:
     void processByteReceived(uint8_t value) {
       if (mouseIsReady()) {
+        bool afterPause = restarted;
+        restarted = false;
 
         // Abort if bit 3 of the first byte is not set
         if (!pindex && !(value & 0b00001000)) return;
+        if (!pindex) packetAfterPause = afterPause;
 
         // Store value
         newPacket[pindex] = value;
         pindex++;
         
         if (pindex == getMousePacketSize()) {
-          if (!updatePacket()) {
+          if (mode == MOUSE_MODE_ACCUMULATE) {
+            accumulatePacket();
+          }
+          else if (updatePacket()) {
+            this->countStat(PS2_STAT_COALESCED);
+          }
+          else {
             i0 = this->head;
             for (uint8_t i = 0; i < getMousePacketSize(); i++) {
               bufferAdd(newPacket[i]);
@@ -780,12 +1806,125 @@ class PS2MousePort : public PS2Port<clkPin, datPin, size>
         }
       }
       else {
+        // Replies to commands go to the buffer, whose blocks may hold button changes
+        if (btnCount > 0) flush();
         bufferAdd(value);
       }
     }
 
+  public:
+    /// @brief Prepares reading the next packet from the buffer byte by byte with nextPacketByte()
+    /// Bytes left unread from the previous packet are discarded first.
+    /// Packets with the overflow bits set are eaten.
+    /// In MOUSE_MODE_ACCUMULATE, the packet is taken from the accumulated movement.
+    /// @return true if a valid packet is ready to be read
+    bool beginPacketRead() {
+      if (mode == MOUSE_MODE_ACCUMULATE) {
+        packetReadLeft = 0;
+        return beginAccumulatedRead();
+      }
+
+      while (packetReadLeft > 0) {
+        this->next();
+        packetReadLeft--;
+      }
+
+      if (this->count() < getMousePacketSize()) return false;
+
+      uint8_t first = this->peek();
+      if ((first & 0b00001000) == 0) {
+        // Not a valid start of packet, eat byte
+        this->next();
+        return false;
+      }
+
+      if ((first & 0b11000000) != 0) {
+        // Overflow, eat packet
+        this->countStat(PS2_STAT_OVERFLOW);
+        for (uint8_t i = 0; i < getMousePacketSize(); i++) {
+          this->next();
+        }
+        return false;
+      }
+
+      packetReadLeft = getMousePacketSize();
+      return true;
+    }
+
+    /// @brief Returns the next byte of the packet prepared by beginPacketRead(), or 0xff past its end
+    uint8_t nextPacketByte() {
+      if (packetReadLeft == 0) return 0xff;
+      if (mode == MOUSE_MODE_ACCUMULATE) {
+        return readPacket[getMousePacketSize() - packetReadLeft--];
+      }
+      packetReadLeft--;
+      return this->next();
+    }
+
+    /// @brief Returns the first byte of the packet prepared by beginPacketRead()
+    uint8_t packetHeader() {
+      return mode == MOUSE_MODE_ACCUMULATE ? readPacket[0] : this->peek();
+    }
+
+    /// @brief Returns true if a complete packet can be read
+    bool packetAvailable() {
+      if (mode == MOUSE_MODE_ACCUMULATE) return btnCount > 0 || accumulatedPending();
+      return this->count() >= getMousePacketSize();
+    }
+
+    /// @brief Number of stored bytes, or in MOUSE_MODE_ACCUMULATE, of pending button changes and movement;
+    /// increases when a packet is stored that was not merged into pending data
+    uint8_t events() {
+      if (mode == MOUSE_MODE_ACCUMULATE) return btnCount + (accumulatedPending() ? 1 : 0);
+      return this->count();
+    }
+
+    uint8_t getMode() {
+      return mode;
+    }
+
+    /// @brief Selects how packets are stored; pending packets are dropped
+    void setMode(uint8_t value) {
+      if (value > MOUSE_MODE_ACCUMULATE) return;
+      uint8_t sreg = SREG;
+      cli();
+      if (mouseIsReady()) flush();    // Keep replies to commands during mouse initialization
+      mode = value;
+      SREG = sreg;
+    }
+
     void flush() {
-      PS2Port<clkPin, datPin, size>::flush();
+      uint8_t sreg = SREG;
+      cli();
+      Base::flush();
+      pindex = 0x00;
+      restarted = packetAfterPause = false;
+      packetReadLeft = 0x00;
+      accX = accY = accW = 0;
+      buttons = reportedButtons = 0;
+      btnCount = 0;
+      SREG = sreg;
+    }
+
+    void receiveError() {
+      // Drop the partial packet, the next packet is found by its header byte
+      pindex = 0x00;
+    }
+
+    void restartCode() {
       pindex = 0x00;
+      restarted = true;
+    }
+
+    /// @brief Returns true if the mouse has sent its BAT code and device ID (0xaa, 0x00) after
+    /// a pause, and then been silent for SCANCODE_TIMEOUT_TICKS, which it does when plugged in.
+    /// A packet is sent without pauses.
+    bool hotPlugged() {
+      if (pindex != 2 || !packetAfterPause || newPacket[0] != 0xaa || newPacket[1] != 0x00 || this->rawAvailable()) return false;
+      uint8_t sreg = SREG;
+      cli();
+      bool silent = this->idleTicks >= SCANCODE_TIMEOUT_TICKS;
+      SREG = sreg;
+      return silent;
     }
 };
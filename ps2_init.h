@@ -0,0 +1,120 @@
+// Copyright 2022-2025 Kevin Williams (TexElec.com), Michael Steil, Joe Burks,
+// Stefan Jakobsson, Eirik Stople, and other contributors.
+// 
+// Redistribution and use in source and binary forms, with or without 
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, 
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#else
+// Host builds of the tests in tests/ps2_init
+#define PROGMEM
+#define pgm_read_byte(addr)     (*(const uint8_t *)(addr))
+#endif
+
+// Table driven initialization state machines of the PS/2 devices.
+//
+// The transitions of a device are a table in flash. The device code collects the events that
+// are true at the moment as a bit mask, and the first transition of the current state, or of
+// PS2_STATE_ANY, whose event is in the mask is taken. Entering a state runs its action, such as
+// sending a command, which may produce events for another transition right away.
+// The tables are in ps2_init_keyboard.h and ps2_init_mouse.h. Like this file, they don't depend
+// on the AVR, so the transitions are checked on a host by tests/ps2_init.
+
+enum PS2_INIT_EVENT : uint8_t {
+  PS2_EVENT_DONE = 0,       // Entry action complete
+  PS2_EVENT_YES,            // Result of a decision state
+  PS2_EVENT_NO,
+  PS2_EVENT_POWER_ON,       // System powered on
+  PS2_EVENT_POWER_OFF,      // System powered off
+  PS2_EVENT_RESET,          // Device reset requested by the host
+  PS2_EVENT_ACK,            // Command acknowledged
+  PS2_EVENT_ERROR,          // Command rejected by the device
+  PS2_EVENT_TIMEOUT,        // Command not clocked in, no device
+  PS2_EVENT_BAT_OK,         // Self test passed (0xaa), or a device was plugged in
+  PS2_EVENT_BAT_FAIL,       // Self test failed (0xfc)
+  PS2_EVENT_BYTE,           // Byte received, mouse only
+  PS2_EVENT_SETTINGS,       // Mouse settings changed by the host
+  PS2_EVENT_WATCHDOG,       // No progress within the watchdog time
+  PS2_EVENT_PROBE,          // Time to probe for a missing device
+  PS2_EVENT_COUNT
+};
+static_assert(PS2_EVENT_COUNT <= 16, "Events must fit in the 16 bit mask");
+
+#define PS2_EVENT(e)            ((uint16_t)1 << (e))
+#define PS2_STATE_ANY           0xff    // Transition taken from any state
+#define PS2_STATE_NONE          0xfe    // No transition
+#define PS2_INIT_MAX_STEPS      8       // Most events handled in one update
+
+struct PS2InitTransition {
+  uint8_t state;
+  uint8_t event;
+  uint8_t next;
+};
+
+/// @brief Looks up the transition taken from a state
+/// @param table Transitions in flash, in priority order
+/// @param count Number of transitions in the table
+/// @param state The current state
+/// @param events Bit mask of the events that are true, see PS2_EVENT()
+/// @return The next state, or PS2_STATE_NONE
+inline uint8_t ps2InitNextState(const PS2InitTransition *table, uint8_t count, uint8_t state, uint16_t events) {
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t from = pgm_read_byte(&table[i].state);
+    if ((from == state || from == PS2_STATE_ANY) && (events & PS2_EVENT(pgm_read_byte(&table[i].event)))) {
+      return pgm_read_byte(&table[i].next);
+    }
+  }
+  return PS2_STATE_NONE;
+}
+
+/// @brief Takes transitions until no event applies to the current state
+/// @param table Transitions in flash, in priority order
+/// @param count Number of transitions in the table
+/// @param state The current state, updated with each transition
+/// @param events Returns the events that are true now. May consume input, such
+/// as a received byte, which sets PS2_EVENT_BYTE.
+/// @param enter Runs the entry action of a state, returns the events it produced
+inline void ps2InitRun(const PS2InitTransition *table, uint8_t count, volatile uint8_t &state, uint16_t (*events)(), uint16_t (*enter)(uint8_t)) {
+  for (uint8_t i = 0; i < PS2_INIT_MAX_STEPS; i++) {
+    uint16_t e = events();
+    if (e == 0) return;
+
+    uint8_t next = ps2InitNextState(table, count, state, e);
+    if (next == PS2_STATE_NONE) {
+      // An unexpected byte is dropped, look at the next one
+      if (e & PS2_EVENT(PS2_EVENT_BYTE)) continue;
+      return;
+    }
+
+    // Enter the state, and any states that follow from its entry action
+    do {
+      state = next;
+      e = enter(next);
+      next = e ? ps2InitNextState(table, count, state, e) : PS2_STATE_NONE;
+    } while (next != PS2_STATE_NONE);
+  }
+}
@@ -0,0 +1,91 @@
+// Copyright 2022-2025 Kevin Williams (TexElec.com), Michael Steil, Joe Burks,
+// Stefan Jakobsson, Eirik Stople, and other contributors.
+// 
+// Redistribution and use in source and binary forms, with or without 
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, 
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "ps2_init.h"
+#include "setup_ps2.h"
+
+// Keyboard initialization state machine, run by setup_keyboard.cpp
+
+/*
+    States, returned to the host at I2C offset 0x1b
+*/
+#define KBD_STATE_OFF                   0x00
+#define KBD_STATE_READY                 0x01
+#define KBD_STATE_BAT                   0x02
+#define KBD_STATE_SET_LEDS              0x03
+#define KBD_STATE_SET_LEDS_ACK          0x04
+#define KBD_STATE_SET_SCANCODE          0x05
+#define KBD_STATE_SET_SCANCODE_ACK      0x06
+#define KBD_STATE_SET_MAKE_BREAK        0x07
+#define KBD_STATE_SET_MAKE_BREAK_ACK    0x08
+#define KBD_STATE_SET3_CHECK            0x09
+#define KBD_STATE_SET3_UNSUPPORTED      0x0a
+#define KBD_STATE_SET3_FAILED           0x0b
+#define KBD_STATE_RESET                 0x10
+#define KBD_STATE_RESET_ACK             0x11
+#define KBD_STATE_ABSENT                0x20
+
+/*
+    State Transitions, in priority order
+*/
+static const PS2InitTransition keyboardTransitions[] PROGMEM = {
+    {PS2_STATE_ANY,                 PS2_EVENT_POWER_OFF,    KBD_STATE_OFF},
+    {PS2_STATE_ANY,                 PS2_EVENT_RESET,        KBD_STATE_RESET},
+    {PS2_STATE_ANY,                 PS2_EVENT_TIMEOUT,      KBD_STATE_ABSENT},
+
+    {KBD_STATE_OFF,                 PS2_EVENT_POWER_ON,     KBD_STATE_BAT},
+    {KBD_STATE_BAT,                 PS2_EVENT_BAT_OK,       KBD_STATE_SET_LEDS},
+    {KBD_STATE_BAT,                 PS2_EVENT_BAT_FAIL,     KBD_STATE_RESET},
+    {KBD_STATE_SET_LEDS,            PS2_EVENT_DONE,         KBD_STATE_SET_LEDS_ACK},
+    {KBD_STATE_SET_LEDS_ACK,        PS2_EVENT_ACK,          KBD_STATE_SET3_CHECK},
+
+    // Scan Code Set 3, if requested
+    {KBD_STATE_SET3_CHECK,          PS2_EVENT_YES,          KBD_STATE_SET_SCANCODE},
+    {KBD_STATE_SET3_CHECK,          PS2_EVENT_NO,           KBD_STATE_READY},
+    {KBD_STATE_SET_SCANCODE,        PS2_EVENT_DONE,         KBD_STATE_SET_SCANCODE_ACK},
+    {KBD_STATE_SET_SCANCODE_ACK,    PS2_EVENT_ACK,          KBD_STATE_SET_MAKE_BREAK},
+    {KBD_STATE_SET_SCANCODE_ACK,    PS2_EVENT_ERROR,        KBD_STATE_SET3_UNSUPPORTED},
+    {KBD_STATE_SET_SCANCODE_ACK,    PS2_EVENT_WATCHDOG,     KBD_STATE_SET3_FAILED},
+    {KBD_STATE_SET_MAKE_BREAK,      PS2_EVENT_DONE,         KBD_STATE_SET_MAKE_BREAK_ACK},
+    {KBD_STATE_SET_MAKE_BREAK_ACK,  PS2_EVENT_ACK,          KBD_STATE_READY},
+    {KBD_STATE_SET_MAKE_BREAK_ACK,  PS2_EVENT_ERROR,        KBD_STATE_SET3_FAILED},
+    {KBD_STATE_SET_MAKE_BREAK_ACK,  PS2_EVENT_WATCHDOG,     KBD_STATE_SET3_FAILED},
+    {KBD_STATE_SET3_UNSUPPORTED,    PS2_EVENT_DONE,         KBD_STATE_READY},
+    {KBD_STATE_SET3_FAILED,         PS2_EVENT_DONE,         KBD_STATE_RESET},
+
+    // A keyboard plugged in while ready, or while missing
+    {KBD_STATE_READY,               PS2_EVENT_BAT_OK,       KBD_STATE_BAT},
+    {KBD_STATE_READY,               PS2_EVENT_BAT_FAIL,     KBD_STATE_BAT},
+    {KBD_STATE_ABSENT,              PS2_EVENT_BAT_OK,       KBD_STATE_BAT},
+    {KBD_STATE_ABSENT,              PS2_EVENT_BAT_FAIL,     KBD_STATE_BAT},
+    {KBD_STATE_ABSENT,              PS2_EVENT_PROBE,        KBD_STATE_RESET},
+
+    {KBD_STATE_RESET,               PS2_EVENT_DONE,         KBD_STATE_RESET_ACK},
+    {KBD_STATE_RESET_ACK,           PS2_EVENT_ACK,          KBD_STATE_BAT},
+
+    {PS2_STATE_ANY,                 PS2_EVENT_WATCHDOG,     KBD_STATE_RESET}
+};
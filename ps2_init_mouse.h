@@ -0,0 +1,136 @@
+// Copyright 2022-2025 Kevin Williams (TexElec.com), Michael Steil, Joe Burks,
+// Stefan Jakobsson, Eirik Stople, and other contributors.
+// 
+// Redistribution and use in source and binary forms, with or without 
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, 
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "ps2_init.h"
+
+// Mouse initialization state machine, run by setup_mouse.cpp
+
+/*
+    State Machine
+*/
+
+// While System Power OFF
+#define MOUSE_STATE_OFF                 0x00
+
+// Power On Test
+#define MOUSE_STATE_BAT                 0x10
+#define MOUSE_STATE_ID                  0x11
+#define MOUSE_STATE_ID_CHECK            0x12
+#define MOUSE_STATE_INTELLI_CHECK       0x13
+
+// Intellimouse extension
+#define MOUSE_STATE_INTELLI_1           0x20
+#define MOUSE_STATE_INTELLI_1_ACK       0x21
+#define MOUSE_STATE_INTELLI_2           0x22
+#define MOUSE_STATE_INTELLI_2_ACK       0x23
+#define MOUSE_STATE_INTELLI_3           0x24
+#define MOUSE_STATE_INTELLI_3_ACK       0x25
+#define MOUSE_STATE_INTELLI_REQ_ID      0x26
+#define MOUSE_STATE_INTELLI_REQ_ID_ACK  0x27
+#define MOUSE_STATE_INTELLI_GET_ID      0x28
+#define MOUSE_STATE_INTELLI_ID_CHECK    0x29
+
+// Setup
+#define MOUSE_STATE_SET_SAMPLERATE      0x30
+#define MOUSE_STATE_SET_SAMPLERATE_ACK  0x31
+#define MOUSE_STATE_SET_RESOLUTION      0x32
+#define MOUSE_STATE_SET_RESOLUTION_ACK  0x33
+#define MOUSE_STATE_SET_SCALING         0x34
+#define MOUSE_STATE_SET_SCALING_ACK     0x35
+#define MOUSE_STATE_ENABLE              0x36
+#define MOUSE_STATE_ENABLE_ACK          0x37
+#define MOUSE_STATE_READY               0x38
+
+#define MOUSE_STATE_FAILED              0x40
+#define MOUSE_STATE_ABSENT              0x41
+#define MOUSE_STATE_PLUGGED_IN          0x42
+
+// Reset
+#define MOUSE_STATE_RESET               0x50
+#define MOUSE_STATE_RESET_ACK           0x51
+
+// Settings changed while ready
+#define MOUSE_STATE_DISABLE             0x60
+#define MOUSE_STATE_DISABLE_ACK         0x61
+
+/*
+    State Transitions, in priority order
+*/
+static const PS2InitTransition mouseTransitions[] PROGMEM = {
+    {PS2_STATE_ANY,                     PS2_EVENT_POWER_OFF,    MOUSE_STATE_OFF},
+    {PS2_STATE_ANY,                     PS2_EVENT_RESET,        MOUSE_STATE_RESET},
+    {PS2_STATE_ANY,                     PS2_EVENT_TIMEOUT,      MOUSE_STATE_ABSENT},
+
+    {MOUSE_STATE_OFF,                   PS2_EVENT_POWER_ON,     MOUSE_STATE_BAT},
+    {MOUSE_STATE_BAT,                   PS2_EVENT_BAT_OK,       MOUSE_STATE_ID},
+    {MOUSE_STATE_BAT,                   PS2_EVENT_BAT_FAIL,     MOUSE_STATE_FAILED},
+    {MOUSE_STATE_ID,                    PS2_EVENT_BYTE,         MOUSE_STATE_ID_CHECK},
+    {MOUSE_STATE_ID_CHECK,              PS2_EVENT_YES,          MOUSE_STATE_INTELLI_CHECK},
+    {MOUSE_STATE_ID_CHECK,              PS2_EVENT_NO,           MOUSE_STATE_RESET},
+
+    // Intellimouse extension, if requested
+    {MOUSE_STATE_INTELLI_CHECK,         PS2_EVENT_YES,          MOUSE_STATE_INTELLI_1},
+    {MOUSE_STATE_INTELLI_CHECK,         PS2_EVENT_NO,           MOUSE_STATE_SET_SAMPLERATE},
+    {MOUSE_STATE_INTELLI_1,             PS2_EVENT_DONE,         MOUSE_STATE_INTELLI_1_ACK},
+    {MOUSE_STATE_INTELLI_1_ACK,         PS2_EVENT_ACK,          MOUSE_STATE_INTELLI_2},
+    {MOUSE_STATE_INTELLI_2,             PS2_EVENT_DONE,         MOUSE_STATE_INTELLI_2_ACK},
+    {MOUSE_STATE_INTELLI_2_ACK,         PS2_EVENT_ACK,          MOUSE_STATE_INTELLI_3},
+    {MOUSE_STATE_INTELLI_3,             PS2_EVENT_DONE,         MOUSE_STATE_INTELLI_3_ACK},
+    {MOUSE_STATE_INTELLI_3_ACK,         PS2_EVENT_ACK,          MOUSE_STATE_INTELLI_REQ_ID},
+    {MOUSE_STATE_INTELLI_REQ_ID,        PS2_EVENT_DONE,         MOUSE_STATE_INTELLI_REQ_ID_ACK},
+    {MOUSE_STATE_INTELLI_REQ_ID_ACK,    PS2_EVENT_ACK,          MOUSE_STATE_INTELLI_GET_ID},
+    {MOUSE_STATE_INTELLI_GET_ID,        PS2_EVENT_BYTE,         MOUSE_STATE_INTELLI_ID_CHECK},
+    {MOUSE_STATE_INTELLI_ID_CHECK,      PS2_EVENT_YES,          MOUSE_STATE_SET_SAMPLERATE},
+    {MOUSE_STATE_INTELLI_ID_CHECK,      PS2_EVENT_NO,           MOUSE_STATE_INTELLI_1},
+
+    // Setup
+    {MOUSE_STATE_SET_SAMPLERATE,        PS2_EVENT_DONE,         MOUSE_STATE_SET_SAMPLERATE_ACK},
+    {MOUSE_STATE_SET_SAMPLERATE_ACK,    PS2_EVENT_ACK,          MOUSE_STATE_SET_RESOLUTION},
+    {MOUSE_STATE_SET_RESOLUTION,        PS2_EVENT_DONE,         MOUSE_STATE_SET_RESOLUTION_ACK},
+    {MOUSE_STATE_SET_RESOLUTION_ACK,    PS2_EVENT_ACK,          MOUSE_STATE_SET_SCALING},
+    {MOUSE_STATE_SET_SCALING,           PS2_EVENT_DONE,         MOUSE_STATE_SET_SCALING_ACK},
+    {MOUSE_STATE_SET_SCALING_ACK,       PS2_EVENT_ACK,          MOUSE_STATE_ENABLE},
+    {MOUSE_STATE_ENABLE,                PS2_EVENT_DONE,         MOUSE_STATE_ENABLE_ACK},
+    {MOUSE_STATE_ENABLE_ACK,            PS2_EVENT_ACK,          MOUSE_STATE_READY},
+
+    // A mouse plugged in while ready, or settings changed
+    {MOUSE_STATE_READY,                 PS2_EVENT_BAT_OK,       MOUSE_STATE_PLUGGED_IN},
+    {MOUSE_STATE_READY,                 PS2_EVENT_SETTINGS,     MOUSE_STATE_DISABLE},
+    {MOUSE_STATE_PLUGGED_IN,            PS2_EVENT_DONE,         MOUSE_STATE_INTELLI_CHECK},
+    {MOUSE_STATE_DISABLE,               PS2_EVENT_DONE,         MOUSE_STATE_DISABLE_ACK},
+    {MOUSE_STATE_DISABLE_ACK,           PS2_EVENT_ACK,          MOUSE_STATE_SET_SAMPLERATE},
+
+    // Try again now and then if failed or missing
+    {MOUSE_STATE_FAILED,                PS2_EVENT_PROBE,        MOUSE_STATE_RESET},
+    {MOUSE_STATE_ABSENT,                PS2_EVENT_BAT_OK,       MOUSE_STATE_ID},
+    {MOUSE_STATE_ABSENT,                PS2_EVENT_PROBE,        MOUSE_STATE_RESET},
+
+    {MOUSE_STATE_RESET,                 PS2_EVENT_DONE,         MOUSE_STATE_RESET_ACK},
+    {MOUSE_STATE_RESET_ACK,             PS2_EVENT_ACK,          MOUSE_STATE_BAT},
+
+    {PS2_STATE_ANY,                     PS2_EVENT_WATCHDOG,     MOUSE_STATE_RESET}
+};
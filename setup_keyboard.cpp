@@ -26,6 +26,7 @@
 #include "ps2.h"
 #include "smc_pins.h"
 #include "setup_ps2.h"
+#include "ps2_init_keyboard.h"
 
 /*
     Watchdog
@@ -45,93 +46,180 @@
 */
 
 #define PS2_CMD_SET_LEDS                0xed
+#define PS2_CMD_SCANCODE_SET            0xf0
+#define PS2_CMD_SET_ALL_TYPEMATIC_MAKE_BREAK  0xfa
 #define PS2_CMD_RESET                   0xff
 
 /*
     Variables
 */
 extern bool SYSTEM_POWERED;
-extern PS2KeyboardPort<PS2_KBD_CLK, PS2_KBD_DAT, 16> Keyboard;
-static volatile uint8_t watchdogExpiryState = KBD_STATE_RESET;
+extern PS2KeyboardPort<PS2_KBD_CLK, PS2_KBD_DAT, 32> Keyboard;
 static volatile uint8_t kbd_init_state = 0;
+static volatile uint8_t requested_scancode_set = 2;
+static volatile bool resetRequested = false;
+static uint8_t watchdog = WATCHDOG_DISABLE;
+static uint8_t probe = 0;
+static bool watchdogExpired = false;
+static bool probeDue = false;
+
+
+static uint16_t keyboardEvents() {
+    if (!SYSTEM_POWERED) {
+        resetRequested = false;
+        return kbd_init_state != KBD_STATE_OFF ? PS2_EVENT(PS2_EVENT_POWER_OFF) : 0;
+    }
 
-
-void keyboardTick() {
-    static uint8_t watchdog = WATCHDOG_DISABLE;
-
-    // Return to OFF state if system powered down
-    if (!SYSTEM_POWERED && kbd_init_state != KBD_STATE_OFF) {
-      Keyboard.flush();
-      Keyboard.clearBAT();
-      kbd_init_state = KBD_STATE_OFF;
-      watchdog = WATCHDOG_DISABLE;
-      return;
+    uint16_t events = 0;
+    if (kbd_init_state == KBD_STATE_OFF) events |= PS2_EVENT(PS2_EVENT_POWER_ON);
+    if (resetRequested) {
+        resetRequested = false;
+        events |= PS2_EVENT(PS2_EVENT_RESET);
+    }
+    if (watchdogExpired) {
+        watchdogExpired = false;
+        events |= PS2_EVENT(PS2_EVENT_WATCHDOG);
+    }
+    if (probeDue) {
+        probeDue = false;
+        events |= PS2_EVENT(PS2_EVENT_PROBE);
     }
 
-    // State machine
-    switch (kbd_init_state) {
-        case KBD_STATE_OFF:
-            if (SYSTEM_POWERED) {
-                kbd_init_state = KBD_STATE_BAT;
-                watchdog = WATCHDOG_ARM;
-            }
+    switch (Keyboard.getCommandStatus()) {
+        case PS2_CMD_STATUS::CMD_ACK:
+            events |= PS2_EVENT(PS2_EVENT_ACK);
             break;
-
-        case KBD_STATE_BAT:
-            if (Keyboard.BAT() == PS2_BAT_OK) {
-                kbd_init_state = KBD_STATE_SET_LEDS;
-                watchdog = WATCHDOG_ARM;
-            } 
-            else if (Keyboard.BAT() == PS2_BAT_FAIL) {
-                kbd_init_state = KBD_STATE_RESET;
-                watchdog = WATCHDOG_ARM;
-            }
+        case PS2_CMD_STATUS::CMD_ERR:
+            events |= PS2_EVENT(PS2_EVENT_ERROR);
             break;
-
-        case KBD_STATE_SET_LEDS:
-            Keyboard.sendPS2Command(PS2_CMD_SET_LEDS, 0x02);
-            kbd_init_state = KBD_STATE_SET_LEDS_ACK;
-            watchdog = WATCHDOG_ARM;
+        case PS2_CMD_STATUS::CMD_TIMEOUT:
+            // The status stays until the next command, which is sent when leaving ABSENT
+            if (kbd_init_state != KBD_STATE_ABSENT) events |= PS2_EVENT(PS2_EVENT_TIMEOUT);
             break;
-
-        case KBD_STATE_SET_LEDS_ACK:
-            if (Keyboard.getCommandStatus() == PS2_CMD_STATUS::CMD_ACK) {
-                kbd_init_state = KBD_STATE_READY;
-                watchdog = WATCHDOG_DISABLE;
-            }
+        default:
             break;
+    }
 
-        case KBD_STATE_READY:
-            break;
+    // The BAT code is also kept while ready if received between scan codes
+    if (Keyboard.BAT() == PS2_BAT_OK) events |= PS2_EVENT(PS2_EVENT_BAT_OK);
+    else if (Keyboard.BAT() == PS2_BAT_FAIL) events |= PS2_EVENT(PS2_EVENT_BAT_FAIL);
+
+    return events;
+}
+
+static uint16_t keyboardEnter(uint8_t state) {
+    // Watchdog while waiting for the keyboard
+    if (state == KBD_STATE_OFF || state == KBD_STATE_READY || state == KBD_STATE_ABSENT) {
+        watchdog = WATCHDOG_DISABLE;
+    }
+    else {
+        watchdog = WATCHDOG_ARM;
+    }
+    watchdogExpired = false;
 
+    switch (state) {
+        case KBD_STATE_OFF:
         case KBD_STATE_RESET:
             Keyboard.flush();
             Keyboard.clearBAT();
-            Keyboard.sendPS2Command(PS2_CMD_RESET);
-            kbd_init_state = KBD_STATE_RESET_ACK;
-            watchdog = WATCHDOG_ARM;
+            Keyboard.setScanCodeSet(2);     // The keyboard returns to Set 2 on reset
+            if (state == KBD_STATE_RESET) {
+                Keyboard.sendPS2Command(PS2_CMD_RESET);
+                return PS2_EVENT(PS2_EVENT_DONE);
+            }
             break;
 
-        case KBD_STATE_RESET_ACK:
-            if (Keyboard.getCommandStatus() == PS2_CMD_STATUS::CMD_ACK) {
-                kbd_init_state = KBD_STATE_BAT;
-                watchdog = WATCHDOG_ARM;
-            }
+        case KBD_STATE_BAT:
+            // Also entered when a keyboard is plugged in, it starts in Set 2 with default settings
+            Keyboard.flush();
+            Keyboard.setScanCodeSet(2);
+            Keyboard.clearCommandTimeout();
+            break;
+
+        case KBD_STATE_SET_LEDS:
+            Keyboard.clearBAT();
+            Keyboard.sendPS2Command(PS2_CMD_SET_LEDS, 0x02);
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case KBD_STATE_SET3_CHECK:
+            return PS2_EVENT(requested_scancode_set == 3 ? PS2_EVENT_YES : PS2_EVENT_NO);
+
+        case KBD_STATE_SET_SCANCODE:
+            Keyboard.sendPS2Command(PS2_CMD_SCANCODE_SET, 3);
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case KBD_STATE_SET_MAKE_BREAK:
+            // The keyboard sends Set 3 codes from now on
+            Keyboard.setScanCodeSet(3);
+            Keyboard.sendPS2Command(PS2_CMD_SET_ALL_TYPEMATIC_MAKE_BREAK);
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case KBD_STATE_SET3_UNSUPPORTED:
+            // Set 3 not supported, the keyboard stays in Set 2
+            requested_scancode_set = 2;
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case KBD_STATE_SET3_FAILED:
+            // No response to the Set 3 commands, or no break codes for all keys
+            // which makes Set 3 unusable: reset to Set 2
+            requested_scancode_set = 2;
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case KBD_STATE_ABSENT:
+            // Wait for the BAT code sent by a keyboard when plugged in, and
+            // send a reset command now and then for a keyboard that didn't
+            probe = PS2_PROBE_TICKS;
             break;
     }
+    return 0;
+}
 
-    if (watchdog > 0) {
-        watchdog--;
-        if (watchdog == 0) {
-            kbd_init_state = watchdogExpiryState;
-        }
+void keyboardUpdate() {
+    ps2InitRun(keyboardTransitions, sizeof(keyboardTransitions) / sizeof(keyboardTransitions[0]),
+        kbd_init_state, keyboardEvents, keyboardEnter);
+}
+
+void keyboardTick() {
+    // Watchdog and probe countdown, once per main loop
+    if (watchdog > 0 && --watchdog == 0) {
+        watchdogExpired = true;
+        Keyboard.countStat(PS2_STAT_WATCHDOG);
     }
+    if (kbd_init_state == KBD_STATE_ABSENT && probe > 0 && --probe == 0) {
+        probeDue = true;
+    }
+
+    keyboardUpdate();
 }
 
 void keyboardReset() {
-  kbd_init_state = KBD_STATE_RESET;
+  resetRequested = true;
+}
+
+void keyboardSetScanCodeSet(uint8_t set) {
+  if (set == 2 || set == 3) {
+    requested_scancode_set = set;
+    resetRequested = true;
+  }
 }
 
 uint8_t getKeyboardState() {
   return kbd_init_state;
 }
+
+bool keyboardIsReady() {
+  return kbd_init_state == KBD_STATE_READY;
+}
+
+uint8_t getKeyboardDeviceStatus() {
+  switch (kbd_init_state) {
+    case KBD_STATE_OFF:
+      return PS2_DEVICE_OFF;
+    case KBD_STATE_READY:
+      return PS2_DEVICE_READY;
+    case KBD_STATE_ABSENT:
+      return PS2_DEVICE_ABSENT;
+    default:
+      return PS2_DEVICE_INITIALIZING;
+  }
+}
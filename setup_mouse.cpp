@@ -26,41 +26,7 @@
 #include "ps2.h"
 #include "smc_pins.h"
 #include "setup_ps2.h"
-
-/*
-    State Machine
-*/
-
-// While System Power OFF
-#define MOUSE_STATE_OFF                 0x00
-
-// Power On Test
-#define MOUSE_STATE_BAT                 0x10
-#define MOUSE_STATE_ID                  0x11
-
-// Intellimouse extension
-#define MOUSE_STATE_INTELLI_1           0x20
-#define MOUSE_STATE_INTELLI_1_ACK       0x21
-#define MOUSE_STATE_INTELLI_2           0x22
-#define MOUSE_STATE_INTELLI_2_ACK       0x23
-#define MOUSE_STATE_INTELLI_3           0x24
-#define MOUSE_STATE_INTELLI_3_ACK       0x25
-#define MOUSE_STATE_INTELLI_REQ_ID      0x26
-#define MOUSE_STATE_INTELLI_REQ_ID_ACK  0x27
-#define MOUSE_STATE_INTELLI_GET_ID      0x28
-
-// Setup
-#define MOUSE_STATE_SET_SAMPLERATE      0x30
-#define MOUSE_STATE_SET_SAMPLERATE_ACK  0x31
-#define MOUSE_STATE_ENABLE              0x32
-#define MOUSE_STATE_ENABLE_ACK          0x33
-#define MOUSE_STATE_READY               0x34
-
-#define MOUSE_STATE_FAILED              0x40
-
-// Reset
-#define MOUSE_STATE_RESET               0x50
-#define MOUSE_STATE_RESET_ACK           0x51
+#include "ps2_init_mouse.h"
 
 /*
     Watchdog
@@ -81,83 +47,122 @@
 #define PS2_CMD_READ_DEVICE_TYPE        0xf2
 #define PS2_CMD_SET_SAMPLE_RATE         0xf3
 #define PS2_CMD_SET_RESOLUTION          0xe8
-#define PS2_CMD_SET_SCALING             0xe6
+#define PS2_CMD_SET_SCALING_1_1         0xe6
+#define PS2_CMD_SET_SCALING_2_1         0xe7
 #define PS2_CMD_ENABLE                  0xf4
+#define PS2_CMD_DISABLE                 0xf5
 #define PS2_CMD_RESET                   0xff
 
 /*
     Variables
 */
 extern bool SYSTEM_POWERED;
-extern PS2Port<PS2_MSE_CLK, PS2_MSE_DAT, 16> Mouse;
+extern PS2MousePort<PS2_MSE_CLK, PS2_MSE_DAT, 32> Mouse;
 static volatile uint8_t mouse_id = PS2_BAT_FAIL;
 static volatile uint8_t requestedmouse_id = 4;
 static volatile uint8_t state = MOUSE_STATE_OFF;
-static volatile uint8_t watchdogExpiryState = MOUSE_STATE_OFF;
+static volatile uint8_t settings[MOUSE_SETTING_COUNT] = {MOUSE_DEFAULT_SAMPLE_RATE, MOUSE_DEFAULT_RESOLUTION, MOUSE_DEFAULT_SCALING};
+static volatile bool settingsChanged = false;   // Set by the host, the settings are sent when the mouse is ready
+static volatile bool resetRequested = false;
+static uint8_t watchdog = WATCHDOG_DISABLE;
+static uint8_t probe = 0;
+static bool watchdogExpired = false;
+static bool probeDue = false;
+static uint8_t lastByte = 0;                    // Byte of the last PS2_EVENT_BYTE
+
+
+static uint16_t mouseEvents() {
+    if (!SYSTEM_POWERED) {
+        resetRequested = false;
+        return state != MOUSE_STATE_OFF ? PS2_EVENT(PS2_EVENT_POWER_OFF) : 0;
+    }
 
+    uint16_t events = 0;
+    if (state == MOUSE_STATE_OFF) events |= PS2_EVENT(PS2_EVENT_POWER_ON);
+    if (resetRequested) {
+        resetRequested = false;
+        events |= PS2_EVENT(PS2_EVENT_RESET);
+    }
+    if (watchdogExpired) {
+        watchdogExpired = false;
+        events |= PS2_EVENT(PS2_EVENT_WATCHDOG);
+    }
+    if (probeDue) {
+        probeDue = false;
+        events |= PS2_EVENT(PS2_EVENT_PROBE);
+    }
 
-void mouseTick() {
-    static uint8_t watchdog = WATCHDOG_DISABLE;
+    // The status stays until the next command, which is sent when leaving ABSENT
+    if (state != MOUSE_STATE_ABSENT && Mouse.getCommandStatus() == PS2_CMD_STATUS::CMD_TIMEOUT) {
+        events |= PS2_EVENT(PS2_EVENT_TIMEOUT);
+    }
+
+    if (state == MOUSE_STATE_READY) {
+        // Received bytes are mouse packets
+        if (Mouse.hotPlugged()) events |= PS2_EVENT(PS2_EVENT_BAT_OK);
+        if (settingsChanged) events |= PS2_EVENT(PS2_EVENT_SETTINGS);
+    }
+    else if (state == MOUSE_STATE_DISABLE_ACK) {
+        // Packets sent before the mouse took the command may still arrive, and any
+        // of their bytes may be 0xfa. Wait for the ACK seen by the command handler,
+        // and drop everything received until then.
+        if (Mouse.getCommandStatus() == PS2_CMD_STATUS::CMD_ACK) {
+            Mouse.flushRaw();
+            Mouse.flush();
+            events |= PS2_EVENT(PS2_EVENT_ACK);
+        }
+    }
+    else if (state != MOUSE_STATE_OFF && state != MOUSE_STATE_FAILED && Mouse.available()) {
+        // Replies to commands are taken from the buffer, one byte at a time
+        lastByte = Mouse.next();
+        events |= PS2_EVENT(PS2_EVENT_BYTE);
+        if (lastByte == PS2_ACK) events |= PS2_EVENT(PS2_EVENT_ACK);
+        else if (lastByte == PS2_BAT_OK) events |= PS2_EVENT(PS2_EVENT_BAT_OK);
+        else if (lastByte == PS2_BAT_FAIL) events |= PS2_EVENT(PS2_EVENT_BAT_FAIL);
+    }
+
+    return events;
+}
+
+static uint16_t mouseEnter(uint8_t newState) {
     uint8_t mouse_id_prev;
-    
-    // Return to OFF state if system powered down
-    if (!SYSTEM_POWERED && state != MOUSE_STATE_OFF) {
-        Mouse.flush();
-        state = MOUSE_STATE_OFF;
+
+    // Watchdog while waiting for the mouse
+    if (newState == MOUSE_STATE_OFF || newState == MOUSE_STATE_READY || newState == MOUSE_STATE_FAILED || newState == MOUSE_STATE_ABSENT) {
         watchdog = WATCHDOG_DISABLE;
-        return;
     }
+    else {
+        watchdog = WATCHDOG_ARM;
+    }
+    watchdogExpired = false;
 
-    // State machine
-    switch (state) {
+    switch (newState) {
         case MOUSE_STATE_OFF:
-            if (SYSTEM_POWERED) {
-                state = MOUSE_STATE_BAT;
-                watchdogExpiryState = MOUSE_STATE_RESET;
-                watchdog = WATCHDOG_ARM;
-            }
+            Mouse.flush();
             break;
 
         case MOUSE_STATE_BAT:
-            if (Mouse.available()) {
-                uint8_t t = Mouse.next();
-                if (t == PS2_BAT_OK) {
-                    state = MOUSE_STATE_ID;
-                    watchdog = WATCHDOG_ARM;
-
-                }
-                else if (t == PS2_BAT_FAIL) {
-                    state = MOUSE_STATE_FAILED;
-                    watchdog = WATCHDOG_DISABLE;
-                }
-            }
+            Mouse.flush();
             break;
 
         case MOUSE_STATE_ID:
-            if (Mouse.available()) {
-                mouse_id = Mouse.next();
-                if (mouse_id != 0) {
-                    mouse_id = PS2_BAT_FAIL;
-                    state = MOUSE_STATE_RESET;
-                    watchdog = WATCHDOG_ARM;
-                }
-                else {
-                    if (requestedmouse_id == 3 || requestedmouse_id == 4) {
-                        state = MOUSE_STATE_INTELLI_1;
-                    }
-                    else {
-                        state = MOUSE_STATE_SET_SAMPLERATE;
-                    }
-                    watchdog = WATCHDOG_ARM;
-                }
-            }
+            Mouse.clearCommandTimeout();
             break;
 
+        case MOUSE_STATE_ID_CHECK:
+            mouse_id = lastByte;
+            if (mouse_id != 0) {
+                mouse_id = PS2_BAT_FAIL;
+                return PS2_EVENT(PS2_EVENT_NO);
+            }
+            return PS2_EVENT(PS2_EVENT_YES);
+
+        case MOUSE_STATE_INTELLI_CHECK:
+            return PS2_EVENT(requestedmouse_id == 3 || requestedmouse_id == 4 ? PS2_EVENT_YES : PS2_EVENT_NO);
+
         case MOUSE_STATE_INTELLI_1:
             Mouse.sendPS2Command(PS2_CMD_SET_SAMPLE_RATE, 200);
-            state = MOUSE_STATE_INTELLI_1_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
+            return PS2_EVENT(PS2_EVENT_DONE);
 
         case MOUSE_STATE_INTELLI_2:
             if (mouse_id == 0) {
@@ -168,105 +173,95 @@ void mouseTick() {
                 // If mouse_id is not 0, this is the 2nd round of Intellimouse setup, go for ID=4
                 Mouse.sendPS2Command(PS2_CMD_SET_SAMPLE_RATE, 200);
             }
-            state = MOUSE_STATE_INTELLI_2_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
+            return PS2_EVENT(PS2_EVENT_DONE);
 
         case MOUSE_STATE_INTELLI_3:
             Mouse.sendPS2Command(PS2_CMD_SET_SAMPLE_RATE, 80);
-            state = MOUSE_STATE_INTELLI_3_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
+            return PS2_EVENT(PS2_EVENT_DONE);
 
         case MOUSE_STATE_INTELLI_REQ_ID:
             Mouse.sendPS2Command(PS2_CMD_READ_DEVICE_TYPE);
-            state = MOUSE_STATE_INTELLI_REQ_ID_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
-        
-        case MOUSE_STATE_INTELLI_GET_ID:
-            if (Mouse.available()) {
-                mouse_id_prev = mouse_id;
-                mouse_id = Mouse.next();
-
-                if (mouse_id == 0 || mouse_id == requestedmouse_id || mouse_id_prev == 3) {
-                    // Intellimouse setup complete:
-                    // mouse_id == 0                 => Not an Intellimouse, stop here
-                    // mouse_id == requestedmouse_id => We got the requested ID, stop here
-                    // mouse_id_prev == 3            => This was the second round, unsuccessul config of ID=4, nothing more to do
-                    state = MOUSE_STATE_SET_SAMPLERATE;
-                }
-                else {
-                    // Run Intellimouse setup again to test ID=4
-                    state = MOUSE_STATE_INTELLI_1;
-                }
-                watchdog = WATCHDOG_DISABLE;
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case MOUSE_STATE_INTELLI_ID_CHECK:
+            mouse_id_prev = mouse_id;
+            mouse_id = lastByte;
+
+            // Intellimouse setup complete:
+            // mouse_id == 0                 => Not an Intellimouse, stop here
+            // mouse_id == requestedmouse_id => We got the requested ID, stop here
+            // mouse_id_prev == 3            => This was the second round, unsuccessul config of ID=4, nothing more to do
+            // Else run Intellimouse setup again to test ID=4
+            if (mouse_id == 0 || mouse_id == requestedmouse_id || mouse_id_prev == 3) {
+                return PS2_EVENT(PS2_EVENT_YES);
             }
-            break;
+            return PS2_EVENT(PS2_EVENT_NO);
 
         case MOUSE_STATE_SET_SAMPLERATE:
-            Mouse.sendPS2Command(PS2_CMD_SET_SAMPLE_RATE, 60);
-            state = MOUSE_STATE_SET_SAMPLERATE_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
+            settingsChanged = false;
+            Mouse.sendPS2Command(PS2_CMD_SET_SAMPLE_RATE, settings[MOUSE_SETTING_SAMPLE_RATE]);
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case MOUSE_STATE_SET_RESOLUTION:
+            Mouse.sendPS2Command(PS2_CMD_SET_RESOLUTION, settings[MOUSE_SETTING_RESOLUTION]);
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case MOUSE_STATE_SET_SCALING:
+            Mouse.sendPS2Command(settings[MOUSE_SETTING_SCALING] == 2 ? PS2_CMD_SET_SCALING_2_1 : PS2_CMD_SET_SCALING_1_1);
+            return PS2_EVENT(PS2_EVENT_DONE);
 
         case MOUSE_STATE_ENABLE:
             Mouse.sendPS2Command(PS2_CMD_ENABLE);
-            state = MOUSE_STATE_ENABLE_ACK;
-            watchdog = WATCHDOG_ARM;
-            break;
-
-        case MOUSE_STATE_READY:
-            watchdog = WATCHDOG_DISABLE;
-            break;
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case MOUSE_STATE_PLUGGED_IN:
+            // The mouse has default settings and ID 0
+            Mouse.flush();
+            mouse_id = 0;
+            return PS2_EVENT(PS2_EVENT_DONE);
+
+        case MOUSE_STATE_DISABLE:
+            // Stop data reporting while the settings are sent, so that
+            // packets are not mixed up with the replies to the commands
+            Mouse.flushRaw();
+            Mouse.flush();
+            Mouse.sendPS2Command(PS2_CMD_DISABLE);
+            return PS2_EVENT(PS2_EVENT_DONE);
 
         case MOUSE_STATE_FAILED:
-            watchdog = WATCHDOG_DISABLE;
+        case MOUSE_STATE_ABSENT:
+            // Wait for the BAT code sent by a mouse when plugged in, and send a reset
+            // command now and then for a mouse that didn't, or that may have been replaced
+            probe = PS2_PROBE_TICKS;
             break;
 
         case MOUSE_STATE_RESET:
             Mouse.sendPS2Command(PS2_CMD_RESET);
-            state = MOUSE_STATE_RESET_ACK;
-            watchdogExpiryState = MOUSE_STATE_RESET;
-            watchdog = WATCHDOG_ARM;
-            break;
-        
-        case MOUSE_STATE_RESET_ACK:
-            if (Mouse.available() && Mouse.next() == PS2_ACK) {
-                state = MOUSE_STATE_BAT;
-                Mouse.flush();
-                watchdog = WATCHDOG_ARM;
-            }
-            break;
+            return PS2_EVENT(PS2_EVENT_DONE);
+    }
+    return 0;
+}
 
+void mouseUpdate() {
+    ps2InitRun(mouseTransitions, sizeof(mouseTransitions) / sizeof(mouseTransitions[0]),
+        state, mouseEvents, mouseEnter);
+}
 
-        default:
-            // case MOUSE_STATE_INTELLI_1_ACK:
-            // case MOUSE_STATE_INTELLI_2_ACK:
-            // case MOUSE_STATE_INTELLI_3_ACK:
-            // case MOUSE_STATE_INTELLI_REQ_ID_ACK
-            // case MOUSE_STATE_SET_SAMPLERATE_ACK:
-            // case MOUSE_STATE_ENABLE_ACK:
-            if (Mouse.available()) {
-                if (Mouse.next() == PS2_ACK) {
-                    state++;
-                    watchdog = WATCHDOG_ARM;
-                }
-            }
-            break;
+void mouseTick() {
+    // Watchdog and probe countdown, once per main loop
+    if (watchdog > 0 && --watchdog == 0) {
+        watchdogExpired = true;
+        Mouse.countStat(PS2_STAT_WATCHDOG);
     }
-
-    // Watchdog countdown
-    if (watchdog > 0) {
-        watchdog--;
-        if (watchdog == 0) {
-            state = watchdogExpiryState;
-        }
+    if ((state == MOUSE_STATE_ABSENT || state == MOUSE_STATE_FAILED) && probe > 0 && --probe == 0) {
+        probeDue = true;
     }
+
+    mouseUpdate();
 }
 
 void mouseReset() {
-  state = MOUSE_STATE_RESET;
+  resetRequested = true;
 }
 
 void mouseSetRequestedId(uint8_t id) {
@@ -274,6 +269,37 @@ void mouseSetRequestedId(uint8_t id) {
   mouseReset();
 }
 
+void mouseSetSetting(uint8_t setting, uint8_t value) {
+  switch (setting) {
+    case MOUSE_SETTING_SAMPLE_RATE:
+      // Sample rates supported by PS/2 mice, in Hz
+      if (value != 10 && value != 20 && value != 40 && value != 60 && value != 80 && value != 100 && value != 200) return;
+      break;
+    case MOUSE_SETTING_RESOLUTION:
+      // 0 = 1, 1 = 2, 2 = 4, 3 = 8 counts/mm
+      if (value > 3) return;
+      break;
+    case MOUSE_SETTING_SCALING:
+      // 1 = 1:1, 2 = 2:1
+      if (value != 1 && value != 2) return;
+      break;
+    default:
+      return;
+  }
+  settings[setting] = value;
+  settingsChanged = true;
+}
+
+uint8_t getMouseSetting(uint8_t setting) {
+  return settings[setting];
+}
+
+void mouseResetSettings() {
+  mouseSetSetting(MOUSE_SETTING_SAMPLE_RATE, MOUSE_DEFAULT_SAMPLE_RATE);
+  mouseSetSetting(MOUSE_SETTING_RESOLUTION, MOUSE_DEFAULT_RESOLUTION);
+  mouseSetSetting(MOUSE_SETTING_SCALING, MOUSE_DEFAULT_SCALING);
+}
+
 uint8_t getMouseId() {
   return mouse_id;
 }
@@ -282,6 +308,21 @@ bool mouseIsReady() {
   return state == MOUSE_STATE_READY;
 }
 
+uint8_t getMouseDeviceStatus() {
+  switch (state) {
+    case MOUSE_STATE_OFF:
+      return PS2_DEVICE_OFF;
+    case MOUSE_STATE_READY:
+      return PS2_DEVICE_READY;
+    case MOUSE_STATE_ABSENT:
+      return PS2_DEVICE_ABSENT;
+    case MOUSE_STATE_FAILED:
+      return PS2_DEVICE_FAILED;
+    default:
+      return PS2_DEVICE_INITIALIZING;
+  }
+}
+
 uint8_t getMousePacketSize() {
   return !mouse_id? 3: 4;
 }
@@ -25,23 +25,46 @@
 
 #pragma once
 
+// Device status reported to the host, common to the keyboard and mouse
+enum PS2_DEVICE_STATUS : uint8_t {
+  PS2_DEVICE_OFF = 0,             // System powered off
+  PS2_DEVICE_ABSENT,              // Nothing answered on the port, probing for a device
+  PS2_DEVICE_INITIALIZING,
+  PS2_DEVICE_READY,
+  PS2_DEVICE_FAILED               // The device failed its self test, retrying
+};
+
+#define PS2_PROBE_TICKS                 25      // Main loop ticks between probes for a missing device
+
  // Mouse
+enum MOUSE_SETTING : uint8_t {
+  MOUSE_SETTING_SAMPLE_RATE = 0,  // Packets per second: 10, 20, 40, 60, 80, 100 or 200
+  MOUSE_SETTING_RESOLUTION,       // 0-3 = 1, 2, 4 or 8 counts/mm
+  MOUSE_SETTING_SCALING,          // 1 = 1:1, 2 = 2:1
+  MOUSE_SETTING_COUNT
+};
+
+#define MOUSE_DEFAULT_SAMPLE_RATE       60
+#define MOUSE_DEFAULT_RESOLUTION        2
+#define MOUSE_DEFAULT_SCALING           1
+
 void mouseTick();
+void mouseUpdate();
 void mouseReset();
 void mouseSetRequestedId(uint8_t);
+void mouseSetSetting(uint8_t, uint8_t);
+uint8_t getMouseSetting(uint8_t);
+void mouseResetSettings();
 uint8_t getMouseId();
 bool mouseIsReady();
+uint8_t getMouseDeviceStatus();
 uint8_t getMousePacketSize();
 
 // Keyboard
-#define KBD_STATE_OFF                   0x00
-#define KBD_STATE_READY                 0x01
-#define KBD_STATE_BAT                   0x02
-#define KBD_STATE_SET_LEDS              0x03
-#define KBD_STATE_SET_LEDS_ACK          0x04
-#define KBD_STATE_RESET                 0x10
-#define KBD_STATE_RESET_ACK             0x11
-
 void keyboardTick();
+void keyboardUpdate();
 void keyboardReset();
+void keyboardSetScanCodeSet(uint8_t);
 uint8_t getKeyboardState();
+bool keyboardIsReady();
+uint8_t getKeyboardDeviceStatus();
@@ -28,6 +28,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include "smc_wire.h"
+#include "isr_stats.h"
 
 /*
    I2C pins
@@ -38,7 +39,7 @@
 /*
   Constants
 */
-#define BUFSIZE                       32
+#define BUFSIZE                       SMC_WIRE_BUFSIZE
 #define MASTER_WRITE                  0
 #define MASTER_READ                   1
 #define SDA_INPUT                     ~(1<<I2C_SDA_PINB)
@@ -51,6 +52,7 @@
 */
 #define I2C_LISTEN                    ((1<<USISIE) | (0<<USIOIE) | (1<<USIWM1) | (0<<USIWM0) | (1<<USICS1) | (0<<USICS0) | (0<<USICLK) | (0<<USITC))
 #define I2C_ACTIVE                    ((1<<USISIE) | (1<<USIOIE) | (1<<USIWM1) | (1<<USIWM0) | (1<<USICS1) | (0<<USICS0) | (0<<USICLK) | (0<<USITC))
+#define I2C_HOLD                      ((0<<USISIE) | (0<<USIOIE) | (1<<USIWM1) | (0<<USIWM0) | (1<<USICS1) | (0<<USICS0) | (0<<USICLK) | (0<<USITC))
 
 /*
    USI Status Register Values
@@ -89,6 +91,11 @@ static volatile uint8_t bufindex = 0;
 static volatile uint8_t buflen = 0;
 static volatile void (*receiveHandler)(uint8_t) = NULL;
 static volatile void (*requestHandler)() = NULL;
+static volatile void (*requestDoneHandler)() = NULL;
+static uint8_t (* volatile streamHandler)() = NULL;
+static volatile bool held = false;
+static volatile uint16_t transactionCount = 0;    // Transactions addressed to us, saturating
+static volatile uint16_t nackCount = 0;           // Bytes NACKed because the buffer was full, saturating
 
 
 /*
@@ -159,6 +166,10 @@ void SmcWire::onRequest(void (*function)()) {
   requestHandler = function;
 }
 
+void SmcWire::onRequestDone(void (*function)()) {
+  requestDoneHandler = function;
+}
+
 void SmcWire::write(uint8_t value) {
   if (ddr == MASTER_READ && buflen < BUFSIZE) {
     buf[buflen] = value;
@@ -166,6 +177,19 @@ void SmcWire::write(uint8_t value) {
   }
 }
 
+// Function:    stream
+//
+// Description: Set a producer that is called for each further byte the
+//              master reads after the bytes in the buffer have been sent.
+//              The producer is only called when the master has ACKed the
+//              previous byte, and it is valid for the current transaction
+//              only. Intended to be called from the request handler.
+void SmcWire::stream(uint8_t (*function)()) {
+  if (ddr == MASTER_READ) {
+    streamHandler = function;
+  }
+}
+
 uint8_t SmcWire::available() {
   return (ddr == MASTER_WRITE) ? buflen - bufindex : 0;
 }
@@ -184,6 +208,41 @@ void SmcWire::clearBuffer() {
   buflen = 0;
 }
 
+// Function:    hold
+//
+// Description: Stretch the clock at the next start condition until release()
+//              is called. Used to finish deferred work before the master
+//              can send the next command. Must be called from the receive
+//              handler.
+void SmcWire::hold() {
+  held = true;
+}
+
+// Function:    release
+//
+// Description: Resume bus processing after hold(). A start condition that
+//              arrived while holding is serviced immediately. Must be called
+//              with interrupts disabled.
+void SmcWire::release() {
+  if (held) {
+    held = false;
+    USICR = I2C_LISTEN;
+  }
+}
+
+uint16_t SmcWire::getTransactionCount() {
+  return transactionCount;
+}
+
+uint16_t SmcWire::getNackCount() {
+  return nackCount;
+}
+
+void SmcWire::clearCounters() {
+  transactionCount = 0;
+  nackCount = 0;
+}
+
 
 /*
    USI Interrupt Handlers
@@ -200,6 +259,8 @@ void SmcWire::clearBuffer() {
    cause of the interrupt.
  */
 ISR(USI_START_vect) {
+  ISR_STATS_BEGIN();
+
   // Ensure SDA is input
   DDRB &= SDA_INPUT;
 
@@ -213,33 +274,56 @@ ISR(USI_START_vect) {
   if (receiveHandler != NULL && ddr == MASTER_WRITE && buflen > 0) {
     receiveHandler(buflen);
   }
+
+  // Invoke callback for completed master read
+  if (ddr == MASTER_READ) {
+    ddr = MASTER_WRITE;
+    if (requestDoneHandler != NULL) requestDoneHandler();
+  }
   
   // Reset buffer
   buflen = 0;
   bufindex = 0;
+  streamHandler = NULL;
 
   if ((p & (1<<I2C_SCL_PINB)) == 0) {
+    if (held) {
+      // Start condition while holding: Leave the start flag set, which keeps SCL
+      // low, and disable the interrupt until release()
+      state = I2C_STATE_STOPPED;
+      USICR = I2C_HOLD;
+      ISR_STATS_END(ISR_STATS_USI_START);
+      return;
+    }
+
     // Start condition: Configure to receive address and R/W bit
     state = I2C_STATE_VERIFY_ADDRESS;
     USICR = I2C_ACTIVE;
     USISR = I2C_CLEAR_START_FLAG | I2C_CLEAR_STOP_FLAG | I2C_COUNT_BYTE;
   }
   else {
-    // Stop condition: Configure to listen for start/stop conditions
+    // Stop condition: Configure to listen for start/stop conditions.
+    // While holding, the next start condition stretches the clock until release()
     state = I2C_STATE_STOPPED;
-    USICR = I2C_LISTEN;
+    USICR = held ? I2C_HOLD : I2C_LISTEN;
     USISR = I2C_CLEAR_START_FLAG | I2C_CLEAR_STOP_FLAG | I2C_CLEAR_OVF_FLAG;
   }
+
+  ISR_STATS_END(ISR_STATS_USI_START);
 }
 
 /**
    Interrupt handler for USI overflow
  */
 ISR(USI_OVF_vect) {
+  ISR_STATS_BEGIN();
+
   switch (state) {
     
     case I2C_STATE_VERIFY_ADDRESS:
       if (address != 0 && (USIDR >> 1) == address) {
+        if (transactionCount != 0xffff) transactionCount++;
+
         // Get R/W from USIDR bit 0
         ddr = (USIDR & 1);
         
@@ -248,7 +332,7 @@ ISR(USI_OVF_vect) {
         }
         else {
           if (requestHandler != NULL) requestHandler();
-          if (buflen == 0) {
+          if (buflen == 0 && streamHandler == NULL) {
             state = I2C_STATE_IGNORE;
             goto clear_and_listen;
           }
@@ -288,6 +372,7 @@ ISR(USI_OVF_vect) {
       }
       else {
         // Send NACK
+        if (nackCount != 0xffff) nackCount++;
         state = I2C_STATE_SLAVE_ABORTED;
         USIDR = 0xff;
       }
@@ -306,6 +391,9 @@ ISR(USI_OVF_vect) {
           USIDR = buf[bufindex];
           bufindex++;
         }
+        else if (streamHandler != NULL) {
+          USIDR = streamHandler();
+        }
         else {
           USIDR = 0xff;
         }
@@ -348,4 +436,6 @@ ISR(USI_OVF_vect) {
         USISR = I2C_CLEAR_OVF_FLAG;
         break;
   }
+
+  ISR_STATS_END(ISR_STATS_USI_OVF);
 }
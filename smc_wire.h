@@ -28,13 +28,22 @@
 #include <Arduino.h>
 #include <stdlib.h>
 
+#define SMC_WIRE_BUFSIZE              32
+
 class SmcWire {
   public:
     void begin(uint8_t addr);
     void onReceive(void (*function)(uint8_t len));
     void onRequest(void (*function)());
+    void onRequestDone(void (*function)());
     void write(uint8_t value);
+    void stream(uint8_t (*function)());
     uint8_t available();
     uint8_t read();
     void clearBuffer();
+    void hold();
+    void release();
+    uint16_t getTransactionCount();
+    uint16_t getNackCount();
+    void clearCounters();
 };
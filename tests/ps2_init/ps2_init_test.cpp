@@ -0,0 +1,212 @@
+// Host test of the PS/2 initialization state machines
+//
+// The transition tables of the keyboard and mouse are walked with the
+// events the devices and the entry actions would produce, and the states
+// taken are compared with the expected ones.
+
+#include <stdio.h>
+#include "../../ps2_init_keyboard.h"
+#include "../../ps2_init_mouse.h"
+
+struct Step {
+  uint16_t events;
+  uint8_t next;       // Expected state, PS2_STATE_NONE if no transition is taken
+};
+
+#define E(e)        PS2_EVENT(PS2_EVENT_##e)
+#define COUNT(t)    (sizeof(t) / sizeof(t[0]))
+
+static int failures = 0;
+
+static void run(const char *name, const PS2InitTransition *table, uint8_t count, uint8_t state, const Step *steps, uint8_t stepCount) {
+  for (uint8_t i = 0; i < stepCount; i++) {
+    uint8_t next = ps2InitNextState(table, count, state, steps[i].events);
+    if (next != steps[i].next) {
+      printf("FAIL %s, step %d: state 0x%02x, events 0x%04x => 0x%02x, expected 0x%02x\n",
+        name, i, state, steps[i].events, next, steps[i].next);
+      failures++;
+      return;
+    }
+    if (next != PS2_STATE_NONE) state = next;
+  }
+  printf("ok   %s\n", name);
+}
+
+#define RUN(name, table, state, steps)  run(name, table, COUNT(table), state, steps, COUNT(steps))
+
+/*
+    Keyboard
+*/
+static const Step keyboardPowerOn[] = {
+  {E(POWER_ON),           KBD_STATE_BAT},
+  {E(ACK),                PS2_STATE_NONE},      // Nothing but the BAT code is taken
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(NO),                 KBD_STATE_READY},
+  {E(BAT_OK),             KBD_STATE_BAT},       // Plugged in again
+  {E(POWER_OFF),          KBD_STATE_OFF},
+};
+
+static const Step keyboardSet3[] = {
+  {E(POWER_ON),           KBD_STATE_BAT},
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(YES),                KBD_STATE_SET_SCANCODE},
+  {E(DONE),               KBD_STATE_SET_SCANCODE_ACK},
+  {E(ACK),                KBD_STATE_SET_MAKE_BREAK},
+  {E(DONE),               KBD_STATE_SET_MAKE_BREAK_ACK},
+  {E(ACK),                KBD_STATE_READY},
+};
+
+static const Step keyboardSet3Unsupported[] = {
+  {E(POWER_ON),           KBD_STATE_BAT},
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(YES),                KBD_STATE_SET_SCANCODE},
+  {E(DONE),               KBD_STATE_SET_SCANCODE_ACK},
+  {E(ERROR),              KBD_STATE_SET3_UNSUPPORTED},
+  {E(DONE),               KBD_STATE_READY},
+};
+
+static const Step keyboardSet3Failed[] = {
+  {E(POWER_ON),           KBD_STATE_BAT},
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(YES),                KBD_STATE_SET_SCANCODE},
+  {E(DONE),               KBD_STATE_SET_SCANCODE_ACK},
+  {E(ACK),                KBD_STATE_SET_MAKE_BREAK},
+  {E(DONE),               KBD_STATE_SET_MAKE_BREAK_ACK},
+  {E(WATCHDOG),           KBD_STATE_SET3_FAILED},
+  {E(DONE),               KBD_STATE_RESET},     // Back to Set 2
+  {E(DONE),               KBD_STATE_RESET_ACK},
+  {E(ACK),                KBD_STATE_BAT},
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(NO),                 KBD_STATE_READY},
+};
+
+static const Step keyboardAbsent[] = {
+  {E(POWER_ON),           KBD_STATE_BAT},
+  {E(WATCHDOG),           KBD_STATE_RESET},     // No BAT code
+  {E(DONE),               KBD_STATE_RESET_ACK},
+  {E(TIMEOUT),            KBD_STATE_ABSENT},    // Reset not clocked in
+  {E(PROBE),              KBD_STATE_RESET},
+  {E(DONE),               KBD_STATE_RESET_ACK},
+  {E(TIMEOUT),            KBD_STATE_ABSENT},
+  {E(BAT_OK),             KBD_STATE_BAT},       // Plugged in
+  {E(BAT_OK),             KBD_STATE_SET_LEDS},
+  {E(DONE),               KBD_STATE_SET_LEDS_ACK},
+  {E(ACK),                KBD_STATE_SET3_CHECK},
+  {E(NO),                 KBD_STATE_READY},
+};
+
+/*
+    Mouse
+*/
+// Mouse with ID 4 (5 buttons), which takes two rounds of the Intellimouse sequence
+static const Step mouseIntellimouse[] = {
+  {E(POWER_ON),           MOUSE_STATE_BAT},
+  {E(BYTE) | E(BAT_OK),   MOUSE_STATE_ID},
+  {E(BYTE),               MOUSE_STATE_ID_CHECK},        // ID 0
+  {E(YES),                MOUSE_STATE_INTELLI_CHECK},
+  {E(YES),                MOUSE_STATE_INTELLI_1},
+  {E(DONE),               MOUSE_STATE_INTELLI_1_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_2},
+  {E(DONE),               MOUSE_STATE_INTELLI_2_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_3},
+  {E(DONE),               MOUSE_STATE_INTELLI_3_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_REQ_ID},
+  {E(DONE),               MOUSE_STATE_INTELLI_REQ_ID_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_GET_ID},
+  {E(BYTE),               MOUSE_STATE_INTELLI_ID_CHECK}, // ID 3
+  {E(NO),                 MOUSE_STATE_INTELLI_1},       // Second round for ID 4
+  {E(DONE),               MOUSE_STATE_INTELLI_1_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_2},
+  {E(DONE),               MOUSE_STATE_INTELLI_2_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_3},
+  {E(DONE),               MOUSE_STATE_INTELLI_3_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_REQ_ID},
+  {E(DONE),               MOUSE_STATE_INTELLI_REQ_ID_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_INTELLI_GET_ID},
+  {E(BYTE),               MOUSE_STATE_INTELLI_ID_CHECK}, // ID 4
+  {E(YES),                MOUSE_STATE_SET_SAMPLERATE},
+  {E(DONE),               MOUSE_STATE_SET_SAMPLERATE_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_SET_RESOLUTION},
+  {E(DONE),               MOUSE_STATE_SET_RESOLUTION_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_SET_SCALING},
+  {E(DONE),               MOUSE_STATE_SET_SCALING_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_ENABLE},
+  {E(DONE),               MOUSE_STATE_ENABLE_ACK},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_READY},
+  {E(SETTINGS),           MOUSE_STATE_DISABLE},
+  {E(DONE),               MOUSE_STATE_DISABLE_ACK},
+  {E(ACK),                MOUSE_STATE_SET_SAMPLERATE},
+};
+
+static const Step mouseUnexpectedBytes[] = {
+  {E(POWER_ON),           MOUSE_STATE_BAT},
+  {E(BYTE),               PS2_STATE_NONE},              // Dropped while waiting for the BAT code
+  {E(BYTE) | E(BAT_FAIL), MOUSE_STATE_FAILED},
+  {E(BYTE) | E(BAT_OK),   PS2_STATE_NONE},
+  {E(PROBE),              MOUSE_STATE_RESET},
+  {E(DONE),               MOUSE_STATE_RESET_ACK},
+  {E(BYTE),               PS2_STATE_NONE},
+  {E(BYTE) | E(ACK),      MOUSE_STATE_BAT},
+};
+
+static const Step mouseAbsent[] = {
+  {E(POWER_ON),           MOUSE_STATE_BAT},
+  {E(WATCHDOG),           MOUSE_STATE_RESET},
+  {E(DONE),               MOUSE_STATE_RESET_ACK},
+  {E(TIMEOUT),            MOUSE_STATE_ABSENT},
+  {E(PROBE),              MOUSE_STATE_RESET},
+  {E(DONE),               MOUSE_STATE_RESET_ACK},
+  {E(TIMEOUT),            MOUSE_STATE_ABSENT},
+  {E(BYTE) | E(BAT_OK),   MOUSE_STATE_ID},              // Plugged in
+  {E(BYTE),               MOUSE_STATE_ID_CHECK},
+  {E(YES),                MOUSE_STATE_INTELLI_CHECK},
+  {E(NO),                 MOUSE_STATE_SET_SAMPLERATE},  // ID 0 requested
+  {E(POWER_OFF),          MOUSE_STATE_OFF},
+};
+
+// A mouse plugged in while the port was ready
+static const Step mouseHotPlug[] = {
+  {E(POWER_ON),           MOUSE_STATE_BAT},
+  {E(BYTE) | E(BAT_OK),   MOUSE_STATE_ID},
+  {E(BYTE),               MOUSE_STATE_ID_CHECK},
+  {E(YES),                MOUSE_STATE_INTELLI_CHECK},
+  {E(NO),                 MOUSE_STATE_SET_SAMPLERATE},
+  {E(DONE),               MOUSE_STATE_SET_SAMPLERATE_ACK},
+  {E(ACK),                MOUSE_STATE_SET_RESOLUTION},
+  {E(DONE),               MOUSE_STATE_SET_RESOLUTION_ACK},
+  {E(ACK),                MOUSE_STATE_SET_SCALING},
+  {E(DONE),               MOUSE_STATE_SET_SCALING_ACK},
+  {E(ACK),                MOUSE_STATE_ENABLE},
+  {E(DONE),               MOUSE_STATE_ENABLE_ACK},
+  {E(ACK),                MOUSE_STATE_READY},
+  {E(BAT_OK),             MOUSE_STATE_PLUGGED_IN},
+  {E(DONE),               MOUSE_STATE_INTELLI_CHECK},
+};
+
+int main() {
+  RUN("keyboard power on",          keyboardTransitions, KBD_STATE_OFF, keyboardPowerOn);
+  RUN("keyboard Set 3",             keyboardTransitions, KBD_STATE_OFF, keyboardSet3);
+  RUN("keyboard Set 3 unsupported", keyboardTransitions, KBD_STATE_OFF, keyboardSet3Unsupported);
+  RUN("keyboard Set 3 failed",      keyboardTransitions, KBD_STATE_OFF, keyboardSet3Failed);
+  RUN("keyboard absent",            keyboardTransitions, KBD_STATE_OFF, keyboardAbsent);
+  RUN("mouse Intellimouse",         mouseTransitions, MOUSE_STATE_OFF, mouseIntellimouse);
+  RUN("mouse unexpected bytes",     mouseTransitions, MOUSE_STATE_OFF, mouseUnexpectedBytes);
+  RUN("mouse absent",               mouseTransitions, MOUSE_STATE_OFF, mouseAbsent);
+  RUN("mouse hot plug",             mouseTransitions, MOUSE_STATE_OFF, mouseHotPlug);
+
+  if (failures) {
+    printf("%d failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -34,6 +34,7 @@
 
 //#define COMMUNITYX16_PINS
 #define ENABLE_NMI_BUT
+#define ENABLE_BOOT_SELFCHECK
 //#define KBDBUF_FULL_DBG
 
 
@@ -49,9 +50,11 @@
 #include "ps2.h"
 #include "smc_wire.h"
 #include "setup_ps2.h"
+#include "isr_stats.h"
 
 #include <avr/boot.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 // ----------------------------------------------------------------
 // Definitions
@@ -91,13 +94,25 @@
 #define I2C_CMD_GET_FUSE_LOCK         0x0b
 #define I2C_CMD_GET_FUSE_EXT          0x0c
 #define I2C_CMD_GET_FUSE_HIGH         0x0d
+#define I2C_CMD_KEY_REMAP             0x10
+#define I2C_CMD_KBD_SEQUENCE          0x14
+#define I2C_CMD_MSE_SEQUENCE          0x15
+#define I2C_CMD_DEVICE_STATUS         0x16
 #define I2C_CMD_GET_KBD_STATUS        0x18
 #define I2C_CMD_KBD_CMD1              0x19
 #define I2C_CMD_KBD_CMD2              0x1a
 #define I2C_CMD_KBD_INIT_STATE        0x1b
+#define I2C_CMD_SCANCODE_SET          0x1c
+#define I2C_CMD_TYPEMATIC_MODE        0x1d
+#define I2C_CMD_TYPEMATIC_DELAY       0x1e
+#define I2C_CMD_TYPEMATIC_RATE        0x1f
 #define I2C_CMD_SET_MOUSE_ID          0x20
 #define I2C_CMD_GET_MOUSE_MOV         0x21
 #define I2C_CMD_GET_MOUSE_ID          0x22
+#define I2C_CMD_MOUSE_MODE            0x23
+#define I2C_CMD_MOUSE_SAMPLE_RATE     0x24
+#define I2C_CMD_MOUSE_RESOLUTION      0x25
+#define I2C_CMD_MOUSE_SCALING         0x26
 #define I2C_CMD_GET_VER1              0x30
 #define I2C_CMD_GET_VER2              0x31
 #define I2C_CMD_GET_VER3              0x32
@@ -105,18 +120,171 @@
 #define I2C_CMD_GET_KEYCODE_FAST      0x41
 #define I2C_CMD_GET_MOUSE_MOV_FAST    0x42
 #define I2C_CMD_GET_PS2DATA_FAST      0x43
+#define I2C_CMD_GET_KEYCODE_BURST     0x44
+#define I2C_CMD_GET_INPUT_EVENTS      0x45
+#define I2C_CMD_INPUT_EVENT_TIME      0x46
+#define I2C_CMD_IRQ_ENABLE            0x48
+#define I2C_CMD_IRQ_PENDING           0x49
+#define I2C_CMD_AUTO_INCREMENT        0x4a
+#define I2C_CMD_GET_KEYS_DOWN         0x4b
+#define I2C_CMD_GET_KEYS_CHANGED      0x4c
+#define I2C_CMD_COUNTERS              0x60
+#define I2C_CMD_GET_BUFFER_STATUS     0x61
+#define I2C_CMD_ISR_STATS             0x62
 #define I2C_CMD_GET_BOOTLDR_VER       0x8e
 #define I2C_CMD_BOOTLDR_START         0x8f
 #define I2C_CMD_SET_FLASH_PAGE        0x90
 #define I2C_CMD_READ_FLASH            0x91
 #define I2C_CMD_WRITE_FLASH           0x92
 #define I2C_CMD_SELF_PROGRAMMING_MODE 0x93
+#define I2C_CMD_FLASH_CRC             0x94
+#define I2C_CMD_GET_APP_CRC           0x95
+
+// I2C register map: descriptor per command offset, for master reads
+#define I2C_REG_COUNT                 (I2C_CMD_GET_APP_CRC + 1)   // Highest readable offset + 1
+#define I2C_REG_NONE                  0x00  // Nothing to send, the request is NACKed
+#define I2C_REG_SHADOW                0x80  // Bits 0-6 = shadow register index
+#define I2C_REG_NACK_EMPTY            0x40  // Read handler; NACK if it has no data. Bits 0-5 = I2C_SEND_HANDLER
+
+enum I2C_SEND_HANDLER : uint8_t {
+  SEND_KEYCODE = 1,
+  SEND_MOUSE_MOV,
+  SEND_PS2DATA,
+  SEND_KEYCODE_BURST,
+  SEND_INPUT_EVENTS,
+  SEND_ECHO,
+  SEND_COUNTERS,
+  SEND_IRQ_ENABLE,
+  SEND_IRQ_PENDING,
+  SEND_LONGPRESS,
+  SEND_KBD_STATUS,
+  SEND_FLASH,
+  SEND_FLASH_CRC,
+  SEND_APP_CRC,
+  SEND_SELF_PROGRAMMING_MODE,
+  SEND_AUTO_INCREMENT,
+  SEND_SCANCODE_SET,
+  SEND_BUFFER_STATUS,
+  SEND_TYPEMATIC,
+  SEND_MOUSE_MODE,
+  SEND_MOUSE_SETTING,
+  SEND_KBD_REPLY,
+  SEND_MSE_REPLY,
+  SEND_INPUT_EVENT_TIME,
+  SEND_KEYS_DOWN,
+  SEND_KEY_REMAP,
+  SEND_DEVICE_STATUS,
+#if defined(ENABLE_ISR_STATS)
+  SEND_ISR_STATS,
+#endif
+  I2C_SEND_HANDLER_COUNT
+};
+
+enum SHADOW_REGISTER : uint8_t {
+  SHADOW_FUSE_LOW = 0,    // Fuses must be in hardware order: low, lock, extended, high
+  SHADOW_FUSE_LOCK,
+  SHADOW_FUSE_EXT,
+  SHADOW_FUSE_HIGH,
+  SHADOW_VER1,
+  SHADOW_VER2,
+  SHADOW_VER3,
+  SHADOW_BOOTLDR_VER,
+  SHADOW_KBD_INIT_STATE,
+  SHADOW_MOUSE_ID,
+  SHADOW_COUNT
+};
+
+// One descriptor byte per command offset: a shadow register or a read handler
+struct I2CRegisterMap {
+  uint8_t reg[I2C_REG_COUNT];
+
+  constexpr I2CRegisterMap() : reg() {
+    reg[I2C_CMD_GET_KEYCODE]            = SEND_KEYCODE;
+    reg[I2C_CMD_GET_LONGPRESS]          = SEND_LONGPRESS;
+    reg[I2C_CMD_ECHO]                   = SEND_ECHO;
+    reg[I2C_CMD_GET_FUSE_LOW]           = I2C_REG_SHADOW | SHADOW_FUSE_LOW;
+    reg[I2C_CMD_GET_FUSE_LOCK]          = I2C_REG_SHADOW | SHADOW_FUSE_LOCK;
+    reg[I2C_CMD_GET_FUSE_EXT]           = I2C_REG_SHADOW | SHADOW_FUSE_EXT;
+    reg[I2C_CMD_GET_FUSE_HIGH]          = I2C_REG_SHADOW | SHADOW_FUSE_HIGH;
+    reg[I2C_CMD_KEY_REMAP]              = SEND_KEY_REMAP;
+    reg[I2C_CMD_KBD_SEQUENCE]           = SEND_KBD_REPLY;
+    reg[I2C_CMD_MSE_SEQUENCE]           = SEND_MSE_REPLY;
+    reg[I2C_CMD_DEVICE_STATUS]          = SEND_DEVICE_STATUS;
+    reg[I2C_CMD_GET_KBD_STATUS]         = SEND_KBD_STATUS;
+    reg[I2C_CMD_KBD_INIT_STATE]         = I2C_REG_SHADOW | SHADOW_KBD_INIT_STATE;
+    reg[I2C_CMD_SCANCODE_SET]           = SEND_SCANCODE_SET;
+    reg[I2C_CMD_TYPEMATIC_MODE]         = SEND_TYPEMATIC;
+    reg[I2C_CMD_TYPEMATIC_DELAY]        = SEND_TYPEMATIC;
+    reg[I2C_CMD_TYPEMATIC_RATE]         = SEND_TYPEMATIC;
+    reg[I2C_CMD_GET_MOUSE_MOV]          = SEND_MOUSE_MOV;
+    reg[I2C_CMD_GET_MOUSE_ID]           = I2C_REG_SHADOW | SHADOW_MOUSE_ID;
+    reg[I2C_CMD_MOUSE_MODE]             = SEND_MOUSE_MODE;
+    reg[I2C_CMD_MOUSE_SAMPLE_RATE]      = SEND_MOUSE_SETTING;
+    reg[I2C_CMD_MOUSE_RESOLUTION]       = SEND_MOUSE_SETTING;
+    reg[I2C_CMD_MOUSE_SCALING]          = SEND_MOUSE_SETTING;
+    reg[I2C_CMD_GET_VER1]               = I2C_REG_SHADOW | SHADOW_VER1;
+    reg[I2C_CMD_GET_VER2]               = I2C_REG_SHADOW | SHADOW_VER2;
+    reg[I2C_CMD_GET_VER3]               = I2C_REG_SHADOW | SHADOW_VER3;
+    reg[I2C_CMD_GET_KEYCODE_FAST]       = I2C_REG_NACK_EMPTY | SEND_KEYCODE;
+    reg[I2C_CMD_GET_MOUSE_MOV_FAST]     = I2C_REG_NACK_EMPTY | SEND_MOUSE_MOV;
+    reg[I2C_CMD_GET_PS2DATA_FAST]       = I2C_REG_NACK_EMPTY | SEND_PS2DATA;
+    reg[I2C_CMD_GET_KEYCODE_BURST]      = SEND_KEYCODE_BURST;
+    reg[I2C_CMD_GET_INPUT_EVENTS]       = SEND_INPUT_EVENTS;
+    reg[I2C_CMD_INPUT_EVENT_TIME]       = SEND_INPUT_EVENT_TIME;
+    reg[I2C_CMD_IRQ_ENABLE]             = SEND_IRQ_ENABLE;
+    reg[I2C_CMD_IRQ_PENDING]            = SEND_IRQ_PENDING;
+    reg[I2C_CMD_AUTO_INCREMENT]         = SEND_AUTO_INCREMENT;
+    reg[I2C_CMD_GET_KEYS_DOWN]          = SEND_KEYS_DOWN;
+#if defined(ENABLE_KEYS_CHANGED)
+    reg[I2C_CMD_GET_KEYS_CHANGED]       = SEND_KEYS_DOWN;
+#endif
+    reg[I2C_CMD_COUNTERS]               = SEND_COUNTERS;
+    reg[I2C_CMD_GET_BUFFER_STATUS]      = SEND_BUFFER_STATUS;
+#if defined(ENABLE_ISR_STATS)
+    reg[I2C_CMD_ISR_STATS]              = SEND_ISR_STATS;
+#endif
+    reg[I2C_CMD_GET_BOOTLDR_VER]        = I2C_REG_SHADOW | SHADOW_BOOTLDR_VER;
+    reg[I2C_CMD_READ_FLASH]             = SEND_FLASH;
+    reg[I2C_CMD_SELF_PROGRAMMING_MODE]  = SEND_SELF_PROGRAMMING_MODE;
+    reg[I2C_CMD_FLASH_CRC]              = SEND_FLASH_CRC;
+    reg[I2C_CMD_GET_APP_CRC]            = SEND_APP_CRC;
+  }
+};
+
+// Read handler, returns false if there was no data available
+typedef bool (*I2CSendHandler)();
+
+// Deferred I2C commands, executed from the main loop
+#define I2C_QUEUE_SIZE                4     // Must be a power of 2
+
+// Host interrupt (IRQB) causes
+#define IRQ_KEYBOARD                  0x01  // Key code available
+#define IRQ_MOUSE                     0x02  // Mouse packet available
+#define IRQ_DEVICE_STATUS             0x04  // Keyboard ready state or mouse device ID changed
+
+// Input event stream tags: bits 4-7 = event type, bits 0-3 = payload length
+#define INPUT_EVENT_END               0x00
+#define INPUT_EVENT_KEY               0x10
+#define INPUT_EVENT_MOUSE_MOTION      0x20
+#define INPUT_EVENT_MOUSE_BUTTON      0x30
+#define INPUT_EVENT_DEVICE_STATUS     0x40
+#define INPUT_EVENT_TIME              0x50
+#define INPUT_EVENT_MAX_SIZE          5     // Tag + 4 byte mouse packet
+#define INPUT_EVENT_TIME_SIZE         2     // Timestamp added to key and mouse events, if enabled
+
+// Input event arrival order, one bit per event: 0 = keyboard, 1 = mouse
+#define INPUT_ORDER_SIZE              32    // Must be a power of 2
 
 // Bootloader
 #define FLASH_SIZE            (0x2000)
 #define BOOTLOADER_SIZE       (0x200)
 #define BOOTLOADER_START_ADDR ((FLASH_SIZE-BOOTLOADER_SIZE+2)>>1)
 
+// Flash CRC calculation status
+#define FLASH_CRC_IDLE        0
+#define FLASH_CRC_REQUESTED   1
+#define FLASH_CRC_BUSY        2
+
 
 // ----------------------------------------------------------------
 // Global Variables
@@ -135,15 +303,41 @@ volatile bool resetRequest = false;
 volatile bool NMIRequest = false;
 uint8_t LONGPRESS_START = 0;	// Used to let CPU know NMI has come with pwr on
 
+// Host interrupt (IRQB)
+volatile uint8_t irqEnable = 0;        // Causes allowed to assert IRQB, 0 = IRQB never driven
+volatile uint8_t irqLatched = 0;       // Pending causes that are cleared by acknowledge
+
+// Timer 1 ticks (100 us) since startup, wraps around
+volatile uint16_t timerTicks = 0;
+
 // I2C
 volatile SmcWire smcWire;
 volatile uint8_t  I2C_Data[3] = {0, 0, 0};
 volatile char echo_byte = 0;
+volatile uint8_t shadowRegs[SHADOW_COUNT];
+volatile uint8_t i2cQueue[I2C_QUEUE_SIZE][3];
+volatile uint8_t i2cQueueHead = 0;
+volatile uint8_t i2cQueueTail = 0;
 
 // PS/2
-volatile PS2KeyboardPort<PS2_KBD_CLK, PS2_KBD_DAT, 16> Keyboard;
-volatile PS2MousePort<PS2_MSE_CLK, PS2_MSE_DAT, 16> Mouse;
+PS2BlockPool ps2Pool;
+PS2HostSequence ps2HostSeq;
+volatile PS2KeyboardPort<PS2_KBD_CLK, PS2_KBD_DAT, 32> Keyboard;
+volatile PS2MousePort<PS2_MSE_CLK, PS2_MSE_DAT, 32> Mouse;
 uint8_t defaultRequest = I2C_CMD_GET_KEYCODE_FAST;
+volatile uint8_t autoIncrement = 0;    // 1 = consecutive bytes map to consecutive offsets
+
+// Input event stream
+volatile uint8_t inputOrder[INPUT_ORDER_SIZE / 8];
+volatile uint8_t inputOrderHead = 0;
+volatile uint8_t inputOrderTail = 0;
+volatile uint8_t inputOrderDelta[INPUT_ORDER_SIZE];  // Timer ticks since the event before, saturating at 255
+volatile uint16_t inputOrderHeadTime = 0;   // Arrival time of the last event added
+volatile uint16_t inputOrderTailTime = 0;   // Arrival time of the last event taken
+volatile bool deviceStatusPending = false;
+volatile uint8_t inputEventTimestamps = 0;  // 1 = key and mouse events carry their arrival time
+bool reportedKeyboardReady = false;
+uint8_t reportedMouseId = 0;
 
 // Button combination, used to start bootloader or activate self programming mode
 volatile uint16_t buttonCombinationTimer = 0;
@@ -155,9 +349,20 @@ enum BUTTON_COMBINATION_ACTION : uint8_t {
 volatile BUTTON_COMBINATION_ACTION buttonCombinationAction = START_BOOTLOADER; // 0: Start bootloader, 1: Activate self programming mode
 volatile uint8_t selfProgrammingModeActive = 0; // 0: Not active, 1: active
 
+volatile uint8_t keyRemapOffset = 0;   // Next key remap table entry read by the host
+uint8_t keyRemapClearIndex = 0;         // Next key remap table entry to clear, 0 = not clearing
+
 volatile uint16_t flash_read_offset = 0;
+volatile uint8_t flash_read_left = 0;
 volatile uint8_t spm_lowByte = 0;
 
+// Flash CRC-16, same algorithm as the Kernal memory_crc function ($FEEA)
+volatile uint8_t flashCrcStatus = FLASH_CRC_IDLE;
+volatile uint8_t flashCrcFirstPage = 0;
+volatile uint8_t flashCrcPages = 0;
+volatile uint16_t flashCrc = 0xffff;
+volatile uint16_t appCrc = 0xffff;    // Application area CRC-16, calculated at startup
+
 // ----------------------------------------------------------------
 // Setup
 // ----------------------------------------------------------------
@@ -224,14 +429,26 @@ void setup() {
   pinMode_opt(NMIB_PIN, OUTPUT);
   digitalWrite_opt(NMIB_PIN, HIGH);
 
+  // Release IRQ; the line is asserted by making the pin an output
+  digitalWrite_opt(IRQB_PIN, LOW);
+  pinMode_opt(IRQB_PIN, INPUT);
+
   // Initialize I2C
   smcWire.begin(I2C_ADDR);
   smcWire.onReceive(I2C_Receive);
   smcWire.onRequest(I2C_Send);
+  smcWire.onRequestDone(updateIrq);
 
   // PS/2 host init
-  Keyboard.begin(keyboardClockIrq);
-  Mouse.begin(mouseClockIrq);
+  Keyboard.begin(keyboardClockIrq, PS2_POOL_KEYBOARD);
+  Mouse.begin(mouseClockIrq, PS2_POOL_MOUSE);
+
+  initShadowRegisters();
+
+#if defined(ENABLE_BOOT_SELFCHECK)
+  // Application area self-check, result is read by the host
+  appCrc = flashCrc16(0, FLASH_SIZE - BOOTLOADER_SIZE);
+#endif
 }
 
 // ----------------------------------------------------------------
@@ -250,11 +467,28 @@ void loop() {
   NMI_BUT.tick();
   #endif
 
-  // Update Keyboard and Mouse Initialization State
+  // Decode received PS/2 data, then update Keyboard and Mouse Initialization State
+  decodePS2();
   mouseTick();
   keyboardTick();
+  keyboardRepeatTick();
+  updateDeviceShadowRegisters();
+
+  // Report keyboard ready and mouse ID changes in the input event stream
+  bool keyboardReady = keyboardIsReady();
+  if (keyboardReady != reportedKeyboardReady || getMouseId() != reportedMouseId) {
+    reportedKeyboardReady = keyboardReady;
+    reportedMouseId = getMouseId();
+    deviceStatusPending = true;
+    cli();
+    irqLatched |= IRQ_DEVICE_STATUS;
+    updateIrq();
+    sei();
+  }
 
   // Process Requests Received over I2C
+  processI2CQueue();
+
   if (powerOffRequest) {
     powerOffRequest = false;
     PowerOffSeq();
@@ -275,6 +509,24 @@ void loop() {
     DoNMI();
   }
 
+  if (flashCrcStatus == FLASH_CRC_REQUESTED) {
+    cli();
+    uint16_t addr = flashCrcFirstPage * 64;
+    uint16_t len = flashCrcPages * 64;
+    flashCrcStatus = FLASH_CRC_BUSY;
+    sei();
+
+    uint16_t crc = flashCrc16(addr, len);
+
+    cli();
+    if (flashCrcStatus == FLASH_CRC_BUSY) {
+      // Not superseded by a new request while calculating
+      flashCrc = crc;
+      flashCrcStatus = FLASH_CRC_IDLE;
+    }
+    sei();
+  }
+
   // Process Keyboard Initiated Reset and NMI Requests
   if (Keyboard.getResetRequest()) {
     DoReset();
@@ -291,8 +543,15 @@ void loop() {
     buttonCombinationTimer--;
   }
 
-  // Short Delay
-  _delay_ms(10);
+  // Short Delay, deferred I2C commands and PS/2 decoding are executed while waiting.
+  // The initialization state machines advance as soon as the devices answer.
+  for (uint8_t i = 0; i < 10; i++) {
+    processI2CQueue();
+    decodePS2();
+    mouseUpdate();
+    keyboardUpdate();
+    _delay_ms(1);
+  }
 }
 
 void initializeButtonCombination(BUTTON_COMBINATION_ACTION action)
@@ -341,11 +600,18 @@ void DoReset() {
     digitalWrite_opt(ACT_LED, ACT_LED_OFF);
     
     Keyboard.flush();
+    Keyboard.resetTypematic();
     Mouse.reset();
+    Mouse.setMode(MOUSE_MODE_PACKET);
+    mouseResetSettings();
+    clearInputOrder();
+    inputEventTimestamps = 0;
     mouseReset();
     keyboardReset();
 
     defaultRequest = I2C_CMD_GET_KEYCODE_FAST;
+    autoIncrement = 0;
+    disableIrq();
   }
 }
 
@@ -364,6 +630,7 @@ void PowerOffSeq() {
   digitalWrite_opt(PWR_ON, HIGH);             // Turn off supply
   Keyboard.reset();                           // Reset and deactivate pullup
   Mouse.reset();                              // Reset and deactivate pullup
+  disableIrq();                               // Never drive IRQB while the CPU is off
   SYSTEM_POWERED = 0;                         // Global Power state Off
   _delay_ms(RESB_HOLDTIME_MS);                    // Mostly here to add some delay between presses
   deassertReset();
@@ -386,6 +653,7 @@ void PowerOnSeq() {
   }
   else {
     defaultRequest = I2C_CMD_GET_KEYCODE_FAST;
+    autoIncrement = 0;
     _delay_ms(RESB_HOLDTIME_MS);                // Allow system to stabilize
     SYSTEM_POWERED = 1;                     // Global Power state On
   }
@@ -413,24 +681,44 @@ void deassertReset() {
 // ----------------------------------------------------------------
 void I2C_Receive(int) {
   int ct = 0;
-  while (smcWire.available()) {
-    if (ct < 3) {                           // read first three bytes only
-      byte c = smcWire.read();
-      I2C_Data[ct] = c;
-      ct++;
-    }
-    else {
-      smcWire.read();                        // eat extra data, should not be sent
-    }
+  while (smcWire.available() && ct < 3) {   // read first three bytes
+    I2C_Data[ct] = smcWire.read();
+    ct++;
   }
 
   // Exit without further action if input less than two bytes
   if (ct < 2) {
     return;
   }
-  
-  // Process bytes received
-  switch (I2C_Data[0]) {
+
+  if (autoIncrement) {
+    // Consecutive data bytes are written to consecutive offsets
+    uint8_t cmd = I2C_Data[0];
+    uint8_t len = ct - 1;
+    while (len > 0) {
+      uint8_t n = I2C_Execute(cmd, len);
+      cmd += n;
+      len -= n;
+      if (len > 0) I2C_Data[1] = I2C_Data[2];
+      while (len < 2 && smcWire.available()) {
+        I2C_Data[1 + len] = smcWire.read();
+        len++;
+      }
+    }
+  }
+  else {
+    I2C_Execute(I2C_Data[0], ct - 1);
+    while (smcWire.available()) smcWire.read();   // eat extra data, should not be sent
+  }
+
+  I2C_Data[0] = defaultRequest;
+}
+
+// Executes a write command, with data bytes in I2C_Data[1] and I2C_Data[2]
+// len: number of data bytes available (1 or 2)
+// Returns the number of data bytes used by the command
+uint8_t I2C_Execute(uint8_t cmd, uint8_t len) {
+  switch (cmd) {
     case I2C_CMD_POW_OFF:
       switch (I2C_Data[1]) {
         case 0: 
@@ -469,8 +757,7 @@ void I2C_Receive(int) {
       break;
     
     case I2C_CMD_DBG_OUT :
-      DBG_PRINT("DBG register 9 called. echo_byte: ");
-      DBG_PRINTLN((byte)(echo_byte), HEX);
+      queueI2CCommand(I2C_CMD_DBG_OUT, 0, 0, false);
       break;
 
     case I2C_CMD_KBD_CMD1:
@@ -478,19 +765,119 @@ void I2C_Receive(int) {
       break;
   
     case I2C_CMD_KBD_CMD2:
-      if (ct >= 3) {
+      if (len >= 2) {
         Keyboard.sendPS2Command(I2C_Data[1], I2C_Data[2]);
+        return 2;
       }
       break;
 
+    case I2C_CMD_KEY_REMAP:
+      // Key number, and optionally the key number it's translated to
+      keyRemapOffset = I2C_Data[1] & (KEY_REMAP_SIZE - 1);
+      if (len >= 2) {
+        // Key numbers above KEY_REMAP_MAX_KEY are ignored, except KEY_REMAP_NONE which removes
+        // a translation. Key 0 only takes 0x00, which clears the table.
+        // Writing the EEPROM takes several ms, which is done in the main loop.
+        // The bus is held until then.
+        uint8_t value = I2C_Data[2];
+        if ((value <= KEY_REMAP_MAX_KEY || value == KEY_REMAP_NONE) && (I2C_Data[1] != 0 || value == 0)) {
+          queueI2CCommand(I2C_CMD_KEY_REMAP, I2C_Data[1], value, true);
+        }
+        return 2;
+      }
+      break;
+
+    case I2C_CMD_KBD_SEQUENCE:
+    case I2C_CMD_MSE_SEQUENCE:
+      {
+        // Command and data bytes, up to PS2_TX_QUEUE_SIZE; any further bytes are dropped
+        uint8_t seq[PS2_TX_QUEUE_SIZE];
+        uint8_t n = 0;
+        for (uint8_t i = 1; i <= len; i++) {
+          seq[n++] = I2C_Data[i];
+        }
+        while (smcWire.available()) {
+          uint8_t value = smcWire.read();
+          if (n < PS2_TX_QUEUE_SIZE) seq[n++] = value;
+        }
+        if (cmd == I2C_CMD_KBD_SEQUENCE) {
+          Keyboard.sendPS2Sequence(seq, n);
+        }
+        else {
+          Mouse.sendPS2Sequence(seq, n);
+        }
+        return len;
+      }
+
+    case I2C_CMD_SCANCODE_SET:
+      keyboardSetScanCodeSet(I2C_Data[1]);
+      break;
+
+    case I2C_CMD_TYPEMATIC_MODE:
+    case I2C_CMD_TYPEMATIC_DELAY:
+    case I2C_CMD_TYPEMATIC_RATE:
+      // Size optimization: Assume that the commands are in the order of PS2_TYPEMATIC_PARAM
+      Keyboard.setTypematic(cmd - I2C_CMD_TYPEMATIC_MODE, I2C_Data[1]);
+      break;
+
     case I2C_CMD_SET_MOUSE_ID:
       mouseSetRequestedId(I2C_Data[1]);
       break;  
 
+    case I2C_CMD_MOUSE_MODE:
+      Mouse.setMode(I2C_Data[1]);
+      break;
+
+    case I2C_CMD_MOUSE_SAMPLE_RATE:
+    case I2C_CMD_MOUSE_RESOLUTION:
+    case I2C_CMD_MOUSE_SCALING:
+      // Size optimization: Assume that the commands are in the order of MOUSE_SETTING
+      mouseSetSetting(cmd - I2C_CMD_MOUSE_SAMPLE_RATE, I2C_Data[1]);
+      break;
+
     case I2C_CMD_SET_DFLT_READ_OP:
       defaultRequest = I2C_Data[1];
       break;
 
+    case I2C_CMD_AUTO_INCREMENT:
+      autoIncrement = I2C_Data[1];
+      break;
+
+    case I2C_CMD_INPUT_EVENT_TIME:
+      inputEventTimestamps = I2C_Data[1];
+      break;
+
+    case I2C_CMD_COUNTERS:
+      if (I2C_Data[1] == 0) {
+        // Reset all counters
+        Keyboard.clearStats();
+        Mouse.clearStats();
+        smcWire.clearCounters();
+      }
+      break;
+
+#if defined(ENABLE_ISR_STATS)
+    case I2C_CMD_ISR_STATS:
+      // Reset all interrupt handler statistics
+      for (uint8_t i = 0; i < ISR_STATS_COUNT; i++) {
+        isrStats[i].count = 0;
+        isrStats[i].max = 0;
+      }
+      isrMaxLatency = 0;
+      break;
+#endif
+
+    case I2C_CMD_IRQ_ENABLE:
+      irqEnable = I2C_Data[1];
+      updateIrq();
+      break;
+
+    case I2C_CMD_IRQ_PENDING:
+      // Acknowledge latched causes
+      irqLatched &= ~I2C_Data[1];
+      updateIrq();
+      break;
+
     case I2C_CMD_BOOTLDR_START:
       if (I2C_Data[1] == 0x31) {
         initializeButtonCombination(START_BOOTLOADER);
@@ -531,12 +918,24 @@ void I2C_Receive(int) {
 
         if ((flash_read_offset & 0x3F) == 0)
         {
-          // Automatically flash page on page boundary (64 bytes)
-          boot_page_erase(page);
-          boot_spm_busy_wait();       // Wait until the memory is erased.
-          boot_page_write(page);      // Store buffer in flash page.
-          boot_spm_busy_wait();       // Wait until the memory is written.
+          // Automatically flash page on page boundary (64 bytes).
+          // Erasing and writing takes several ms, which is done in the main loop.
+          // The bus is held until then, so that the page is written before the next command.
+          queueI2CCommand(I2C_CMD_WRITE_FLASH, page & 0xff, page >> 8, true);
+        }
+      }
+      break;
+
+    case I2C_CMD_FLASH_CRC:
+      // Calculated in the main loop: first page, number of pages.
+      // A range past the end of the flash memory is ignored.
+      if (len >= 2) {
+        if ((uint16_t)I2C_Data[1] + I2C_Data[2] <= FLASH_SIZE / 64) {
+          flashCrcFirstPage = I2C_Data[1];
+          flashCrcPages = I2C_Data[2];
+          flashCrcStatus = FLASH_CRC_REQUESTED;
         }
+        return 2;
       }
       break;
 
@@ -552,8 +951,110 @@ void I2C_Receive(int) {
       }
       break;
   }
-  
-  I2C_Data[0] = defaultRequest;
+
+  return 1;
+}
+
+// Adds a command to the deferred command queue. If ordered is true, or if the queue
+// is full, the I2C bus is held until the queue has been processed.
+// Called from the I2C interrupt.
+void queueI2CCommand(uint8_t cmd, uint8_t data1, uint8_t data2, bool ordered) {
+  uint8_t headNext = (i2cQueueHead + 1) & (I2C_QUEUE_SIZE - 1);
+  i2cQueue[i2cQueueHead][0] = cmd;
+  i2cQueue[i2cQueueHead][1] = data1;
+  i2cQueue[i2cQueueHead][2] = data2;
+  i2cQueueHead = headNext;
+  if (ordered || ((headNext + 1) & (I2C_QUEUE_SIZE - 1)) == i2cQueueTail) {
+    smcWire.hold();
+  }
+}
+
+// Executes commands deferred by the I2C interrupt, and releases the
+// I2C bus when the queue is empty
+void processI2CQueue() {
+  clearKeyRemapStep();
+
+  while (i2cQueueTail != i2cQueueHead) {
+    volatile uint8_t *entry = i2cQueue[i2cQueueTail];
+    switch (entry[0]) {
+      case I2C_CMD_DBG_OUT:
+        DBG_PRINT("DBG register 9 called. echo_byte: ");
+        DBG_PRINTLN((byte)(echo_byte), HEX);
+        break;
+
+      case I2C_CMD_WRITE_FLASH:
+        writeFlashPage(entry[1] | (entry[2] << 8));
+        updateBootloaderVersion();
+        break;
+
+      case I2C_CMD_KEY_REMAP:
+        if (keyRemapClearIndex != 0) {
+          // Written when the table has been cleared, the bus is held until then
+          return;
+        }
+        writeKeyRemap(entry[1], entry[2]);
+        break;
+    }
+    i2cQueueTail = (i2cQueueTail + 1) & (I2C_QUEUE_SIZE - 1);
+  }
+
+  cli();
+  if (i2cQueueTail == i2cQueueHead) smcWire.release();
+  sei();
+}
+
+void writeFlashPage(uint16_t page) {
+  // The CPU is halted while erasing and writing, and PS/2 clock interrupts
+  // are missed. Inhibit the devices, making them buffer their data.
+  cli();
+  Keyboard.inhibit();
+  Mouse.inhibit();
+  sei();
+  _delay_us(100);
+
+  cli();
+  boot_page_erase(page);
+  boot_spm_busy_wait();       // Wait until the memory is erased.
+  boot_page_write(page);      // Store buffer in flash page.
+  boot_spm_busy_wait();       // Wait until the memory is written.
+
+  Keyboard.uninhibit();
+  Mouse.uninhibit();
+  sei();
+}
+
+// Writes a key remap table entry, or if key is 0, starts clearing the table.
+// Key codes are translated in the main loop, so the table is never read while it's written.
+// The main loop is blocked until the EEPROM write is done, during which the raw PS/2 queues
+// could overflow. Inhibit the devices, making them buffer their data.
+void writeKeyRemap(uint8_t key, uint8_t value) {
+  if (key == 0) {
+    keyRemapClearIndex = 1;
+    return;
+  }
+
+  cli();
+  Keyboard.inhibit();
+  Mouse.inhibit();
+  sei();
+
+  eeprom_update_byte((uint8_t *)(KEY_REMAP_EEPROM_ADDR + (key & (KEY_REMAP_SIZE - 1))), value);
+  eeprom_busy_wait();
+
+  cli();
+  Keyboard.uninhibit();
+  Mouse.uninhibit();
+  sei();
+}
+
+// Clears the next key remap table entry, once the EEPROM is done with the last one.
+// The table is cleared one entry per call, so that neither the I2C bus nor the PS/2
+// devices are held for the 127 writes, about 430 ms.
+void clearKeyRemapStep() {
+  if (keyRemapClearIndex == 0 || !eeprom_is_ready()) return;
+
+  eeprom_update_byte((uint8_t *)(KEY_REMAP_EEPROM_ADDR + keyRemapClearIndex), KEY_REMAP_NONE);
+  keyRemapClearIndex = (keyRemapClearIndex + 1) & (KEY_REMAP_SIZE - 1);
 }
 
 // readFuse:
@@ -568,99 +1069,307 @@ uint8_t readFuse(uint8_t address)
   return boot_lock_fuse_bits_get(address);
 }
 
-void I2C_Send() { 
-  uint8_t request = I2C_Data[0];
-  switch (request) {
-    case I2C_CMD_GET_KEYCODE_FAST:
-      if (!sendKeyCode()) smcWire.clearBuffer();
-      break;
-    
-    case I2C_CMD_GET_PS2DATA_FAST:
-      {
-        bool kbd_avail = sendKeyCode();
-        bool mse_avail = sendMousePacket();
-        if (!kbd_avail && !mse_avail) smcWire.clearBuffer();
-      }
-      break;
+// Read-only values that don't change, or only change in the main loop, are
+// kept in shadow registers so that reading them is a single load in the ISR
+void initShadowRegisters() {
+  cli();
+  for (uint8_t i = 0; i < 4; i++) {
+    // Size optimization: Shadow fuse registers are in hardware order
+    shadowRegs[SHADOW_FUSE_LOW + i] = readFuse(i);
+  }
+  sei();
+  shadowRegs[SHADOW_VER1] = version_major;
+  shadowRegs[SHADOW_VER2] = version_minor;
+  shadowRegs[SHADOW_VER3] = version_patch;
+  updateBootloaderVersion();
+  updateDeviceShadowRegisters();
+}
 
-    case I2C_CMD_GET_MOUSE_MOV_FAST:
-      if (!sendMousePacket()) smcWire.clearBuffer();
-      break;
-      
-    case I2C_CMD_GET_KEYCODE:
-      sendKeyCode();
-      break;
-      
-    case I2C_CMD_GET_MOUSE_MOV:
-      sendMousePacket();
-      break;
-    
-    case I2C_CMD_ECHO:
-      smcWire.write(echo_byte);
-      break;
+void updateBootloaderVersion() {
+  if (pgm_read_byte(0x1e00) == 0x8a) {
+    // Bootloader version 1 and 2
+    shadowRegs[SHADOW_BOOTLDR_VER] = pgm_read_byte(0x1e01);
+  }
+  else if (pgm_read_byte(0x1ffe) == 0x8a) {
+    // From bootloader version 3
+    shadowRegs[SHADOW_BOOTLDR_VER] = pgm_read_byte(0x1fff);
+  }
+  else {
+    shadowRegs[SHADOW_BOOTLDR_VER] = 0xff;
+  }
+}
 
-    case I2C_CMD_GET_LONGPRESS:
-      smcWire.write(LONGPRESS_START);
-      break;
+void updateDeviceShadowRegisters() {
+  shadowRegs[SHADOW_KBD_INIT_STATE] = getKeyboardState();
+  shadowRegs[SHADOW_MOUSE_ID] = getMouseId();
+}
 
-    case I2C_CMD_GET_KBD_STATUS:
-      smcWire.write(Keyboard.getCommandStatus());
-      break;
+// Read handlers
 
-    case I2C_CMD_KBD_INIT_STATE:
-      smcWire.write(getKeyboardState());
-      break;
+bool sendPS2Data() {
+  bool kbd_avail = sendKeyCode();
+  bool mse_avail = sendMousePacket();
+  return kbd_avail || mse_avail;
+}
 
-    case I2C_CMD_GET_MOUSE_ID:
-      smcWire.write(getMouseId());
-      break;
+bool sendEcho() {
+  smcWire.write(echo_byte);
+  return true;
+}
 
-    case I2C_CMD_GET_VER1:
-      smcWire.write(version_major);
-      break;
+bool sendIrqEnable() {
+  smcWire.write(irqEnable);
+  return true;
+}
 
-    case I2C_CMD_GET_VER2:
-      smcWire.write(version_minor);
-      break;
+bool sendIrqPending() {
+  smcWire.write(getIrqPending());
+  return true;
+}
 
-    case I2C_CMD_GET_VER3:
-      smcWire.write(version_patch);
-      break;
+bool sendLongPress() {
+  smcWire.write(LONGPRESS_START);
+  return true;
+}
 
-    case I2C_CMD_GET_BOOTLDR_VER:
-      if (pgm_read_byte(0x1e00) == 0x8a) {
-        // Bootloader version 1 and 2
-        smcWire.write(pgm_read_byte(0x1e01));
-      }
-      else if (pgm_read_byte(0x1ffe) == 0x8a) {
-        // From bootloader version 3
-        smcWire.write(pgm_read_byte(0x1fff));
-      }
-      else {
-        smcWire.write(0xff);
-      }
-      break;
+bool sendKbdCommandStatus() {
+  smcWire.write(Keyboard.getCommandStatus());
+  return true;
+}
 
-    case I2C_CMD_READ_FLASH: // Raw read from flash
-      smcWire.write(pgm_read_byte(flash_read_offset++));
-      break;
+bool sendKbdReply() {
+  // Command status, number of reply bytes, reply bytes
+  smcWire.write(Keyboard.getCommandStatus());
+  smcWire.write(Keyboard.getReplySize());
+  for (uint8_t i = 0; i < Keyboard.getReplySize(); i++) {
+    smcWire.write(Keyboard.getReply(i));
+  }
+  return true;
+}
 
-    case I2C_CMD_SELF_PROGRAMMING_MODE: // Check if self programming mode is activated
-      smcWire.write(selfProgrammingModeActive);
-      break;
+bool sendMouseReply() {
+  smcWire.write(Mouse.getCommandStatus());
+  smcWire.write(Mouse.getReplySize());
+  for (uint8_t i = 0; i < Mouse.getReplySize(); i++) {
+    smcWire.write(Mouse.getReply(i));
+  }
+  return true;
+}
 
-    case I2C_CMD_GET_FUSE_LOW:
-    case I2C_CMD_GET_FUSE_LOCK:
-    case I2C_CMD_GET_FUSE_EXT:
-    case I2C_CMD_GET_FUSE_HIGH: // Read fuses
-      // Size optimization: Assume that numeric values of these commands are in this order, to fit with hardware
-      smcWire.write(readFuse(request - I2C_CMD_GET_FUSE_LOW));
-      break;
+bool sendKeyRemap() {
+  // Table entries from the selected key number, produced as the master reads them
+  smcWire.stream(nextKeyRemapByte);
+  return true;
+}
+
+uint8_t nextKeyRemapByte() {
+  uint8_t key = keyRemapOffset;
+  keyRemapOffset = (key + 1) & (KEY_REMAP_SIZE - 1);
+  return Keyboard.remapKey(key);
+}
+
+bool sendDeviceStatus() {
+  smcWire.write(getKeyboardDeviceStatus());
+  smcWire.write(getMouseDeviceStatus());
+  return true;
+}
+
+bool sendFlash() {
+  // Raw read from flash, up to one page per transaction
+  flash_read_left = 64;
+  smcWire.stream(nextFlashByte);
+  return true;
+}
+
+bool sendFlashCrc() {
+  // NACK until the calculation is done
+  if (flashCrcStatus != FLASH_CRC_IDLE) return false;
+  smcWire.write(flashCrc & 0xff);
+  smcWire.write(flashCrc >> 8);
+  return true;
+}
+
+bool sendAppCrc() {
+  smcWire.write(appCrc & 0xff);
+  smcWire.write(appCrc >> 8);
+  return true;
+}
+
+bool sendBufferStatus() {
+  // Bytes and pool blocks used by each device, and free pool blocks
+  smcWire.write(Keyboard.count());
+  smcWire.write(Keyboard.blockCount());
+  smcWire.write(Mouse.count());
+  smcWire.write(Mouse.blockCount());
+  smcWire.write(ps2Pool.freeBlocks());
+  return true;
+}
+
+bool sendTypematic() {
+  smcWire.write(Keyboard.getTypematic(I2C_Data[0] - I2C_CMD_TYPEMATIC_MODE));
+  return true;
+}
+
+bool sendMouseMode() {
+  smcWire.write(Mouse.getMode());
+  return true;
+}
+
+bool sendMouseSetting() {
+  smcWire.write(getMouseSetting(I2C_Data[0] - I2C_CMD_MOUSE_SAMPLE_RATE));
+  return true;
+}
+
+bool sendScanCodeSet() {
+  smcWire.write(Keyboard.getScanCodeSet());
+  return true;
+}
+
+bool sendInputEventTime() {
+  smcWire.write(inputEventTimestamps);
+  return true;
+}
+
+bool sendKeysDown() {
+  // Key-down bitmap, followed by the keys changed since the last read if requested
+  for (uint8_t i = 0; i < KEY_MAP_SIZE; i++) {
+    smcWire.write(Keyboard.getKeysDown(i));
+  }
+#if defined(ENABLE_KEYS_CHANGED)
+  if (I2C_Data[0] == I2C_CMD_GET_KEYS_CHANGED) {
+    for (uint8_t i = 0; i < KEY_MAP_SIZE; i++) {
+      smcWire.write(Keyboard.takeKeysChanged(i));
+    }
+  }
+#endif
+  return true;
+}
+
+bool sendAutoIncrement() {
+  smcWire.write(autoIncrement);
+  return true;
+}
+
+bool sendSelfProgrammingMode() {
+  // Check if self programming mode is activated
+  smcWire.write(selfProgrammingModeActive);
+  return true;
+}
+
+// Read handler table, indexed by I2C_SEND_HANDLER - 1
+const I2CSendHandler i2cSendHandlers[] PROGMEM = {
+  sendKeyCode,
+  sendMousePacket,
+  sendPS2Data,
+  sendKeyCodeBurst,
+  sendInputEvents,
+  sendEcho,
+  sendCounters,
+  sendIrqEnable,
+  sendIrqPending,
+  sendLongPress,
+  sendKbdCommandStatus,
+  sendFlash,
+  sendFlashCrc,
+  sendAppCrc,
+  sendSelfProgrammingMode,
+  sendAutoIncrement,
+  sendScanCodeSet,
+  sendBufferStatus,
+  sendTypematic,
+  sendMouseMode,
+  sendMouseSetting,
+  sendKbdReply,
+  sendMouseReply,
+  sendInputEventTime,
+  sendKeysDown,
+  sendKeyRemap,
+  sendDeviceStatus,
+#if defined(ENABLE_ISR_STATS)
+  sendIsrStats,
+#endif
+};
+static_assert(sizeof(i2cSendHandlers) / sizeof(i2cSendHandlers[0]) == I2C_SEND_HANDLER_COUNT - 1);
+
+// Register map for master reads, generated at compile time
+const I2CRegisterMap i2cRegisterMap PROGMEM;
+
+uint8_t getI2CRegister(uint8_t offset) {
+  return (offset < I2C_REG_COUNT) ? pgm_read_byte(&i2cRegisterMap.reg[offset]) : I2C_REG_NONE;
+}
+
+void I2C_Send() { 
+  uint8_t offset = I2C_Data[0];
+  uint8_t reg = getI2CRegister(offset);
+
+  if (reg & I2C_REG_SHADOW) {
+    // In auto-increment mode, consecutive shadow registers are returned in one read
+    do {
+      smcWire.write(shadowRegs[reg & ~I2C_REG_SHADOW]);
+      reg = getI2CRegister(++offset);
+    } while (autoIncrement && (reg & I2C_REG_SHADOW));
+  }
+  else if (reg != I2C_REG_NONE) {
+    I2CSendHandler handler = (I2CSendHandler)pgm_read_word(&i2cSendHandlers[(reg & ~I2C_REG_NACK_EMPTY) - 1]);
+    if (!handler() && (reg & I2C_REG_NACK_EMPTY)) {
+      // Fast read operations NACK the request if there is no data
+      smcWire.clearBuffer();
+    }
   }
   
   I2C_Data[0] = defaultRequest;
 }
 
+uint8_t nextFlashByte() {
+  if (flash_read_left == 0) return 0xff;
+  flash_read_left--;
+  return pgm_read_byte(flash_read_offset++);
+}
+
+void sendCounter(uint16_t value) {
+  smcWire.write(value & 0xff);
+  smcWire.write(value >> 8);
+}
+
+bool sendCounters() {
+  // Snapshot of all counters, 16 bits each, low byte first
+  for (uint8_t i = 0; i < PS2_STAT_COUNT; i++) {
+    sendCounter(Keyboard.getStat(i));
+  }
+  for (uint8_t i = 0; i < PS2_STAT_COUNT; i++) {
+    sendCounter(Mouse.getStat(i));
+  }
+  sendCounter(smcWire.getTransactionCount());
+  sendCounter(smcWire.getNackCount());
+  return true;
+}
+
+#if defined(ENABLE_ISR_STATS)
+volatile IsrStats isrStats[ISR_STATS_COUNT];
+volatile uint8_t isrMaxLatency = 0;
+
+bool sendIsrStats() {
+  // Count, max and average run time per handler, followed by the worst Timer 1 entry latency
+  for (uint8_t i = 0; i < ISR_STATS_COUNT; i++) {
+    sendCounter(isrStats[i].count);
+    smcWire.write(isrStats[i].max);
+    smcWire.write((isrStats[i].average + 0x80) >> 8);
+  }
+  smcWire.write(isrMaxLatency);
+  return true;
+}
+#endif
+
+uint16_t flashCrc16(uint16_t addr, uint16_t len) {
+  // CRC-16/CCITT: polynomial 0x1021, initial value 0xffff
+  uint16_t crc = 0xffff;
+  while (len > 0) {
+    crc = _crc_xmodem_update(crc, pgm_read_byte(addr++));
+    len--;
+  }
+  return crc;
+}
+
 bool sendKeyCode() {
   if (Keyboard.available()) {
     smcWire.write(Keyboard.next());
@@ -670,43 +1379,264 @@ bool sendKeyCode() {
   return false;
 }
 
+// Number of key codes announced by the count byte of the current burst read
+volatile uint8_t keyCodeBurstLeft = 0;
+
+bool sendKeyCodeBurst() {
+  // Leading count byte, followed by that many key codes produced as the master reads them
+  uint8_t n = Keyboard.count();
+  if (n > SMC_WIRE_BUFSIZE - 1) n = SMC_WIRE_BUFSIZE - 1;
+  smcWire.write(n);
+  keyCodeBurstLeft = n;
+  smcWire.stream(nextKeyCodeBurstByte);
+  return n > 0;
+}
+
+uint8_t nextKeyCodeBurstByte() {
+  if (keyCodeBurstLeft == 0) return 0xff;
+  keyCodeBurstLeft--;
+  return Keyboard.next();
+}
+
 bool sendMousePacket() {
-  if (Mouse.count() >= getMousePacketSize()) {
-    uint8_t first = Mouse.next();
-    if ((first & 0b00001000) == 0b00001000) {
-      // Valid start of packet
-      if ((first & 0b11000000) == 0) {
-        // No overflow
-        smcWire.write(first);
-        for (uint8_t i = 1; i < getMousePacketSize(); i++) {
-          smcWire.write(Mouse.next());
-        }
-        return true;
-      }
-      else {
-        // Overflow, eat packet
-        for (uint8_t i = 1; i < getMousePacketSize(); i++) {
-          Mouse.next();
-        }
-      }
-    }
+  if (Mouse.beginPacketRead()) {
+    // Packet bytes are taken from the buffer as the master reads them
+    smcWire.stream(nextMousePacketByte);
+    return true;
   }
   smcWire.write(0);
   return false;
 }
 
+uint8_t nextMousePacketByte() {
+  return Mouse.nextPacketByte();
+}
+
+// ----------------------------------------------------------------
+// Input Event Stream
+// ----------------------------------------------------------------
+
+// The event stream returns keyboard and mouse events in the order they
+// arrived. Each event is a tag byte (type and payload length) followed by
+// the payload. The stream is terminated by an INPUT_EVENT_END tag, and no
+// event is started that would not fit in SMC_WIRE_BUFSIZE bytes.
+// With timestamps enabled, the stream starts with the current time, and the
+// payload of key and mouse events starts with the time the event arrived.
+
+volatile uint8_t inputEventBytes = 0;       // Bytes produced in the current transaction
+volatile uint8_t inputEventType = INPUT_EVENT_END;
+volatile uint8_t inputEventLeft = 0;        // Payload bytes left of the current event
+volatile uint8_t inputEventTimeLeft = 0;    // Timestamp bytes left of the current event
+volatile uint16_t inputEventTime = 0;
+volatile uint8_t inputEventButtons = 0;     // Mouse buttons of the last mouse event
+
+void pushInputOrder(uint8_t isMouse, uint16_t time) {
+  uint8_t headNext = (inputOrderHead + 1) & (INPUT_ORDER_SIZE - 1);
+  if (headNext == inputOrderTail) return;   // Full, events are then returned device by device
+  uint8_t mask = 1 << (inputOrderHead & 7);
+  if (isMouse) inputOrder[inputOrderHead >> 3] |= mask;
+  else inputOrder[inputOrderHead >> 3] &= ~mask;
+
+  // Arrival times are stored as the time since the event before. Events decoded out of
+  // order by a few ticks count as simultaneous.
+  int16_t delta = time - inputOrderHeadTime;
+  if (inputOrderHead == inputOrderTail) {
+    inputOrderTailTime = time;
+    delta = 0;
+  }
+  inputOrderDelta[inputOrderHead] = delta < 0 ? 0 : (delta > 255 ? 255 : delta);
+  inputOrderHeadTime = time;
+  inputOrderHead = headNext;
+}
+
+void clearInputOrder() {
+  inputOrderHead = inputOrderTail = 0;
+  inputEventButtons = 0;
+}
+
+bool sendInputEvents() {
+  inputEventBytes = 0;
+  inputEventLeft = 0;
+  inputEventTimeLeft = 0;
+  if (inputEventTimestamps) {
+    // Current time, for the host to calculate the age of the events
+    inputEventType = INPUT_EVENT_TIME;
+    inputEventLeft = inputEventTimeLeft = INPUT_EVENT_TIME_SIZE;
+    inputEventTime = timerTicks;
+    smcWire.write(INPUT_EVENT_TIME | INPUT_EVENT_TIME_SIZE);
+    inputEventBytes = 1;
+  }
+  smcWire.stream(nextInputEventByte);
+  return true;
+}
+
+uint8_t nextInputEventByte() {
+  if (inputEventBytes >= SMC_WIRE_BUFSIZE) {
+    // The stream has ended, the rest of the transaction is 0x00
+    return INPUT_EVENT_END;
+  }
+  inputEventBytes++;
+
+  if (inputEventLeft > 0) {
+    // Payload
+    inputEventLeft--;
+    if (inputEventTimeLeft > 0) {
+      // Timestamp, low byte first
+      return (inputEventTimeLeft-- == INPUT_EVENT_TIME_SIZE) ? inputEventTime & 0xff : inputEventTime >> 8;
+    }
+    switch (inputEventType) {
+      case INPUT_EVENT_KEY:
+        return Keyboard.next();
+      case INPUT_EVENT_DEVICE_STATUS:
+        return inputEventLeft ? getKeyboardState() : getMouseId();
+      default:
+        return Mouse.nextPacketByte();
+    }
+  }
+
+  // Start of next event, unless it might not fit
+  inputEventType = INPUT_EVENT_END;
+  uint8_t timeSize = inputEventTimestamps ? INPUT_EVENT_TIME_SIZE : 0;
+  if (inputEventBytes + INPUT_EVENT_MAX_SIZE + timeSize - 1 > SMC_WIRE_BUFSIZE) {
+    inputEventBytes = SMC_WIRE_BUFSIZE;
+    return INPUT_EVENT_END;
+  }
+
+  if (deviceStatusPending) {
+    deviceStatusPending = false;
+    irqLatched &= ~IRQ_DEVICE_STATUS;
+    inputEventType = INPUT_EVENT_DEVICE_STATUS;
+    inputEventLeft = 2;
+    return INPUT_EVENT_DEVICE_STATUS | 2;
+  }
+
+  // Take devices in arrival order, skipping entries whose data has already been read by other commands.
+  // If the order buffer is empty while data is available, it overflowed; return the data device by device.
+  bool isMouse;
+  do {
+    if (inputOrderHead != inputOrderTail) {
+      isMouse = inputOrder[inputOrderTail >> 3] & (1 << (inputOrderTail & 7));
+      inputOrderTailTime += inputOrderDelta[inputOrderTail];
+      inputEventTime = inputOrderTailTime;
+      inputOrderTail = (inputOrderTail + 1) & (INPUT_ORDER_SIZE - 1);
+    }
+    else {
+      isMouse = !Keyboard.available();
+      inputEventTime = timerTicks;    // Arrival time unknown
+    }
+
+    if (!isMouse && Keyboard.available()) {
+      inputEventType = INPUT_EVENT_KEY;
+      inputEventLeft = 1;
+    }
+    else if (isMouse && Mouse.beginPacketRead()) {
+      inputEventType = ((Mouse.packetHeader() ^ inputEventButtons) & 0x07) ? INPUT_EVENT_MOUSE_BUTTON : INPUT_EVENT_MOUSE_MOTION;
+      inputEventButtons = Mouse.packetHeader() & 0x07;
+      inputEventLeft = getMousePacketSize();
+    }
+  } while (inputEventType == INPUT_EVENT_END && inputOrderHead != inputOrderTail);
+
+  if (inputEventType == INPUT_EVENT_END) {
+    // Nothing pending; events arriving later are left for the next transaction
+    inputEventBytes = SMC_WIRE_BUFSIZE;
+    return INPUT_EVENT_END;
+  }
+  inputEventTimeLeft = timeSize;
+  inputEventLeft += timeSize;
+  return inputEventType | inputEventLeft;
+}
+
+// ----------------------------------------------------------------
+// Host Interrupt (IRQB)
+// ----------------------------------------------------------------
+
+// IRQB is asserted while any enabled cause is pending. Keyboard and mouse
+// causes clear by themselves when the host has read the data; latched
+// causes are cleared by writing them to I2C_CMD_IRQ_PENDING.
+// Must be called with interrupts disabled.
+
+uint8_t getIrqPending() {
+  uint8_t pending = irqLatched;
+  if (Keyboard.available()) pending |= IRQ_KEYBOARD;
+  if (mouseIsReady() && Mouse.packetAvailable()) pending |= IRQ_MOUSE;
+  return pending;
+}
+
+void updateIrq() {
+  if (getIrqPending() & irqEnable) {
+    pinMode_opt(IRQB_PIN, OUTPUT);
+  }
+  else {
+    pinMode_opt(IRQB_PIN, INPUT);
+  }
+}
+
+void disableIrq() {
+  irqEnable = 0;
+  irqLatched = 0;
+  pinMode_opt(IRQB_PIN, INPUT);
+}
+
 // ----------------------------------------------------------------
 // PS/2 Functions
 // ----------------------------------------------------------------
 
 void keyboardClockIrq() {
+  ISR_STATS_BEGIN();
   Keyboard.onFallingClock();
+  ISR_STATS_END(ISR_STATS_KBD_CLOCK);
 }
 
 void mouseClockIrq() {
+  ISR_STATS_BEGIN();
   Mouse.onFallingClock();
+  ISR_STATS_END(ISR_STATS_MSE_CLOCK);
+}
+
+// Bottom half of the PS/2 clock interrupts: translates key codes and merges mouse packets.
+// Each byte is decoded with interrupts disabled, as the buffers are also read by the I2C interrupt.
+void decodePS2() {
+  while (Keyboard.rawAvailable()) {
+    cli();
+    uint16_t time = Keyboard.rawTimestamp();
+    uint8_t n = Keyboard.count();
+    Keyboard.decodeNext();
+    n = Keyboard.count() - n;
+    if (n > 0) {
+      while (n--) pushInputOrder(0, time);
+      if (irqEnable) updateIrq();
+    }
+    sei();
+  }
+
+  while (Mouse.rawAvailable()) {
+    cli();
+    uint16_t time = Mouse.rawTimestamp();
+    uint8_t n = Mouse.events();
+    Mouse.decodeNext();
+    if (Mouse.events() > n && mouseIsReady()) {
+      pushInputOrder(1, time);
+      if (irqEnable) updateIrq();
+    }
+    sei();
+  }
 }
 
+void keyboardRepeatTick() {
+  // Key repeats generated by the SMC are reported like keys from the keyboard.
+  // Nothing is repeated while the keyboard is missing or being set up.
+  if (getKeyboardDeviceStatus() != PS2_DEVICE_READY) return;
+  cli();
+  uint8_t n = Keyboard.count();
+  Keyboard.typematicTick();
+  if (Keyboard.count() != n) {
+    pushInputOrder(0, timerTicks);
+    if (irqEnable) updateIrq();
+  }
+  sei();
+}
+
+
 
 // ----------------------------------------------------------------
 // Evaluate button combination (power + reset)
@@ -739,12 +1669,15 @@ void evaluateButtonCombination() {
 // ----------------------------------------------------------------
 ISR(TIMER1_COMPA_vect) {
 #if defined(__AVR_ATtiny861__)
+  ISR_STATS_BEGIN_TIMER1();
   // Reset counter since timer1 doesn't reset itself.
   TC1H = 0;
   TCNT1 = 0;
 #endif
+  timerTicks++;
   Keyboard.timerInterrupt();
   Mouse.timerInterrupt();
+  ISR_STATS_END(ISR_STATS_TIMER1);
 }
 
 bool PWR_ON_active()